@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include "../../include/lexExtern.h"
+
+// The lexer as it was before the source buffer: every byte comes through
+// std::ifstream::get(), identifiers are built up in a std::string and
+// checked against the keywords one comparison at a time. Kept only as the
+// baseline the benchmarks measure against. Comments are skipped character
+// by character, which is cheaper than the recursive skip it used to do.
+class IfstreamLexer {
+ private:
+  std::ifstream file;
+  int lastChar = ' ';
+
+  int advance() {
+    int c = file.get();
+
+    if (c == '\n' || c == '\r') {
+      lexLoc.line++;
+      lexLoc.col = 0;
+    } else {
+      lexLoc.col++;
+    }
+    return c;
+  }
+
+ public:
+  std::string identifierStr;
+  double numVal = 0;
+  SourceLocation lexLoc = {1, 0};
+
+  bool openSource(const std::string &name) {
+    file.open(name);
+    return file.is_open();
+  }
+
+  static int lookupKeyword(const std::string &str) {
+    if (str == "def" || str == "DEF" || str == "define") {
+      return tok_def;
+    } else if (str == "extern" || str == "EXTERN") {
+      return tok_extern;
+    } else if (str == "if" || str == "IF") {
+      return tok_if;
+    } else if (str == "then" || str == "THEN") {
+      return tok_then;
+    } else if (str == "else" || str == "ELSE") {
+      return tok_else;
+    } else if (str == "for" || str == "FOR") {
+      return tok_for;
+    } else if (str == "when" || str == "WHEN") {
+      return tok_when;
+    } else if (str == "inc" || str == "INC") {
+      return tok_inc;
+    } else if (str == "do" || str == "DO") {
+      return tok_do;
+    } else if (str == "binary") {
+      return tok_binary;
+    } else if (str == "unary") {
+      return tok_unary;
+    } else if (str == "var" || str == "VAR") {
+      return tok_var;
+    } else if (str == "in" || str == "IN") {
+      return tok_in;
+    }
+    return tok_identifier;
+  }
+
+  int getToken() {
+    while (true) {
+      while (isspace(lastChar)) {
+        lastChar = advance();
+      }
+      if (lastChar != '#') {
+        break;
+      }
+      do {
+        lastChar = advance();
+      } while (lastChar != EOF && lastChar != '\n' && lastChar != '\r');
+    }
+
+    if (isalpha(lastChar)) {
+      identifierStr.erase();
+      identifierStr.push_back(lastChar);
+
+      while (isalnum(lastChar = advance())) {
+        identifierStr.push_back(lastChar);
+      }
+      return lookupKeyword(identifierStr);
+    } else if (isdigit(lastChar) || lastChar == '.') {
+      std::string numStr;
+      do {
+        numStr.push_back(lastChar);
+        lastChar = advance();
+      } while (isdigit(lastChar) || lastChar == '.');
+
+      numVal = strtod(numStr.c_str(), 0);
+      return tok_number;
+    } else if (lastChar == EOF) {
+      return tok_eof;
+    }
+
+    int thisChar = lastChar;
+    lastChar = advance();
+    return thisChar;
+  }
+};
@@ -0,0 +1,142 @@
+// Keyword lookup cost against the size of the keyword set.
+//
+//   keywordBench [runs]
+//
+// For keyword sets of 8, 16, 32 and 64 made-up words, times the perfect
+// hash the lexer uses (include/keywordTable.h) and a chain of comparisons in
+// keyword order, the shape of the old lexer's if-chain. Hits look up the
+// keywords themselves in a shuffled order; misses look up identifiers of
+// the same lengths that are not keywords, which run the whole chain. The
+// hash should cost the same at every size; the chain grows with the set.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../../include/keywordTable.h"
+
+namespace {
+constexpr long lookups = 1 << 22;
+constexpr size_t queryCount = 4096;
+
+unsigned long long rngState = 88172645463325252ull;
+
+unsigned nextRandom() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 7;
+  rngState ^= rngState << 17;
+  return (unsigned)(rngState >> 32);
+}
+
+// A lower-case word of 2 to 8 letters, like the language's keywords.
+std::string randomWord() {
+  std::string word(2 + nextRandom() % 7, ' ');
+  for (char &c : word) {
+    c = 'a' + nextRandom() % 26;
+  }
+  return word;
+}
+
+bool contains(const std::vector<std::string> &words, const std::string &w) {
+  for (const auto &word : words) {
+    if (word == w) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// count words that are neither in avoid nor repeated.
+std::vector<std::string> uniqueWords(size_t count,
+                                     const std::vector<std::string> &avoid) {
+  std::vector<std::string> words;
+  while (words.size() < count) {
+    std::string word = randomWord();
+    if (!contains(words, word) && !contains(avoid, word)) {
+      words.push_back(word);
+    }
+  }
+  return words;
+}
+
+std::vector<std::string_view> queriesFrom(
+    const std::vector<std::string> &words) {
+  std::vector<std::string_view> queries;
+  for (size_t i = 0; i < queryCount; i++) {
+    queries.push_back(words[nextRandom() % words.size()]);
+  }
+  return queries;
+}
+
+int chainLookup(const std::vector<std::string_view> &keywords,
+                std::string_view word) {
+  for (size_t i = 0; i < keywords.size(); i++) {
+    if (keywords[i] == word) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+// Best nanoseconds per lookup over runs passes of lookups calls.
+template <typename Lookup>
+double timeLookups(const std::vector<std::string_view> &queries, int runs,
+                   Lookup lookup) {
+  double best = 0;
+  for (int r = 0; r < runs; r++) {
+    volatile int sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < lookups; i++) {
+      sink = sink + lookup(queries[i & (queryCount - 1)]);
+    }
+    double ns = std::chrono::duration<double, std::nano>(
+                    std::chrono::steady_clock::now() - start)
+                    .count() /
+                lookups;
+    best = r == 0 || ns < best ? ns : best;
+  }
+  return best;
+}
+
+template <unsigned Bits>
+bool benchSet(size_t count, int runs) {
+  std::vector<std::string> words = uniqueWords(count, {});
+  std::vector<std::string> others = uniqueWords(count, words);
+  std::vector<std::string_view> keywords(words.begin(), words.end());
+
+  auto spelling = [&](size_t i) { return keywords[i]; };
+  KeywordTable<Bits> table = buildKeywordTable<Bits>(count, spelling);
+  if (table.seed == 0) {
+    fprintf(stderr, "LogError: No perfect hash for %zu keywords in %u slots\n",
+            count, KeywordTable<Bits>::size);
+    return false;
+  }
+
+  auto hash = [&](std::string_view w) {
+    return table.find(w.data(), w.size(), spelling);
+  };
+  auto chain = [&](std::string_view w) { return chainLookup(keywords, w); };
+
+  std::vector<std::string_view> hits = queriesFrom(words);
+  std::vector<std::string_view> misses = queriesFrom(others);
+  printf("%8zu %6u %9.2f %10.2f %10.2f %11.2f\n", count,
+         KeywordTable<Bits>::size, timeLookups(hits, runs, hash),
+         timeLookups(misses, runs, hash), timeLookups(hits, runs, chain),
+         timeLookups(misses, runs, chain));
+  return true;
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  int runs = argc > 1 ? atoi(argv[1]) : 3;
+
+  printf("%8s %6s %9s %10s %10s %11s\n", "keywords", "slots", "hash hit",
+         "hash miss", "chain hit", "chain miss");
+  bool ok = benchSet<6>(8, runs) && benchSet<8>(16, runs) &&
+            benchSet<10>(32, runs) && benchSet<12>(64, runs);
+  printf("(ns per lookup)\n");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,88 @@
+// Lexing throughput of the buffered Lexer against the old ifstream path.
+//
+//   lexBench <file> [runs]
+//
+// Each run lexes the whole file from a cold start (open, tokenise, close)
+// and the fastest run is reported.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "../../include/lexExtern.h"
+#include "ifstreamLexer.h"
+
+namespace {
+struct Result {
+  long tokens = 0;
+  double seconds = 0;
+};
+
+template <typename Fn>
+Result bestOf(int runs, Fn lexOnce) {
+  Result best;
+  for (int i = 0; i < runs; i++) {
+    auto start = std::chrono::steady_clock::now();
+    long tokens = lexOnce();
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    if (i == 0 || seconds < best.seconds) {
+      best = {tokens, seconds};
+    }
+  }
+  return best;
+}
+
+void report(const char *name, const Result &result, double megabytes) {
+  printf("%-10s %10ld tokens %9.3f s %9.1f MB/s\n", name, result.tokens,
+         result.seconds, megabytes / result.seconds);
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: lexBench <file> [runs]\n");
+    return 1;
+  }
+  std::string fileName = argv[1];
+  int runs = argc > 2 ? atoi(argv[2]) : 3;
+
+  double megabytes = 0;
+  Result buffered = bestOf(runs, [&] {
+    SymbolTable symbols;
+    Lexer lexer(symbols);
+    if (!lexer.openSource(fileName)) {
+      fprintf(stderr, "LogError: Could not open %s\n", fileName.c_str());
+      exit(1);
+    }
+    long tokens = 0;
+    while (lexer.getToken() != tok_eof) {
+      tokens++;
+    }
+    return tokens;
+  });
+
+  Result stream = bestOf(runs, [&] {
+    IfstreamLexer lexer;
+    lexer.openSource(fileName);
+    long tokens = 0;
+    while (lexer.getToken() != tok_eof) {
+      tokens++;
+    }
+    return tokens;
+  });
+
+  if (FILE *f = fopen(fileName.c_str(), "rb")) {
+    fseek(f, 0, SEEK_END);
+    megabytes = ftell(f) / 1e6;
+    fclose(f);
+  }
+
+  printf("%s: %.1f MB\n", fileName.c_str(), megabytes);
+  report("buffered", buffered, megabytes);
+  report("ifstream", stream, megabytes);
+  printf("speedup    %.2fx\n", stream.seconds / buffered.seconds);
+  return 0;
+}
@@ -0,0 +1,96 @@
+// Heap allocations and time of compiling one source, once through the front
+// end alone (-fsyntax-only) and once to an -O0 object, and the bytes the
+// AST nodes took in their per-definition arenas.
+//
+//   allocBench <file> <object>
+//
+// Every operator new in the process is counted, LLVM's included, so the
+// -O0 figures show how much of the total the front end still accounts for.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include "../../include/compilerSession.h"
+
+namespace {
+std::atomic<unsigned long> allocations(0);
+std::atomic<unsigned long> allocatedBytes(0);
+
+void *countedAlloc(size_t size, size_t alignment) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+  void *p = nullptr;
+  if (alignment <= alignof(std::max_align_t)) {
+    p = malloc(size ? size : 1);
+  } else if (posix_memalign(&p, alignment, size ? size : 1) != 0) {
+    p = nullptr;
+  }
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void measure(const char *name, const std::string &fileName,
+             const std::string &objectName, bool syntaxOnly) {
+  CompilerOptions options;
+  options.fileName = fileName;
+  options.outFileName = objectName;
+  options.optLevel = OptimizationLevel::O0;
+  options.printIR = false;
+  options.syntaxOnly = syntaxOnly;
+
+  unsigned long startAllocations = allocations;
+  unsigned long startBytes = allocatedBytes;
+  size_t nodeBytes;
+  auto start = std::chrono::steady_clock::now();
+  {
+    CompilerSession session(options);
+    if (!session.openSource(fileName)) {
+      fprintf(stderr, "LogError: Could not open %s\n", fileName.c_str());
+      exit(1);
+    }
+    session.compile();
+    nodeBytes = session.getASTBytesAllocated();
+  }
+  double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+
+  printf("%-12s %10lu allocations %9.1f MB %9.3f s, AST nodes %.1f MB\n",
+         name, allocations - startAllocations,
+         (allocatedBytes - startBytes) / 1e6, seconds, nodeBytes / 1e6);
+}
+}  // namespace
+
+void *operator new(size_t size) { return countedAlloc(size, 0); }
+void *operator new[](size_t size) { return countedAlloc(size, 0); }
+void *operator new(size_t size, std::align_val_t alignment) {
+  return countedAlloc(size, static_cast<size_t>(alignment));
+}
+void *operator new[](size_t size, std::align_val_t alignment) {
+  return countedAlloc(size, static_cast<size_t>(alignment));
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+  free(p);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: allocBench <file> <object>\n");
+    return 1;
+  }
+
+  measure("front end", argv[1], argv[2], true);
+  measure("-O0 object", argv[1], argv[2], false);
+  return 0;
+}
@@ -0,0 +1,47 @@
+// Peak memory of one run of a command, for systems without GNU time.
+//
+//   maxRss <command> [args...]
+//
+// Runs the command with its output thrown away and prints the largest
+// resident set size it reached, in MB. Exits with the command's status, or
+// 1 if it could not be run or was killed.
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: maxRss <command> [args...]\n");
+    return 1;
+  }
+
+  pid_t child = fork();
+  if (child < 0) {
+    perror("fork");
+    return 1;
+  }
+  if (child == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+      dup2(null, STDOUT_FILENO);
+      dup2(null, STDERR_FILENO);
+    }
+    execvp(argv[1], argv + 1);
+    _exit(127);
+  }
+
+  int status;
+  struct rusage usage;
+  if (wait4(child, &status, 0, &usage) < 0) {
+    perror("wait4");
+    return 1;
+  }
+
+  // ru_maxrss is in kilobytes on Linux.
+  printf("%.1f MB\n", usage.ru_maxrss / 1024.0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
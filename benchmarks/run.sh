@@ -0,0 +1,504 @@
+#!/bin/sh
+# Builds and runs the compiler benchmarks. The tree has no build manifest, so
+# every benchmark program is compiled straight from the sources against the
+# LLVM that llvm-config points at.
+#
+#   benchmarks/run.sh [benchmark]...
+#
+# The benchmarks are lexer, keywords, scan, codegen, parse, alloc, run, lazy,
+# tier, cache, incremental, jobs, pipeline, split, olevels, loops and
+# fastmath.
+# With no arguments every benchmark runs. Inputs are generated into
+# $BENCH_OUT (default /tmp/slbench); $BENCH_MB sets the corpus size.
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+out=${BENCH_OUT:-/tmp/slbench}
+mb=${BENCH_MB:-64}
+runs=${BENCH_RUNS:-3}
+cxx=${CXX:-c++}
+llvmConfig=${LLVM_CONFIG:-llvm-config}
+
+cxxflags="-O2 $($llvmConfig --cppflags) -std=c++17"
+ldflags="$($llvmConfig --ldflags) $($llvmConfig --libs) -pthread"
+
+mkdir -p "$out"
+
+# Runs the awk loop body until it has printed $mb MB into $out/<name>-<mb>mb.sl
+# and leaves that path in $corpus. Existing corpora are reused.
+generate() {
+  corpus="$out/$1-${mb}mb.sl"
+  shift
+  if [ ! -f "$corpus" ]; then
+    awk -v bytes=$((mb * 1000000)) "BEGIN { n = 0; while (n < bytes) { $* } }" \
+      > "$corpus"
+  fi
+}
+
+lexerBench() {
+  $cxx $cxxflags "$root/benchmarks/lexer/lexBench.cpp" "$root/src/lexer.cpp" \
+    "$root/src/lexScan.cpp" $ldflags -o "$out/lexBench"
+
+  # Function definitions shaped like the generated sources we compile.
+  generate mixed 'i++; line = sprintf("def f%d(a, b) var t = a * 1.5 in (for j = 0 when j < b inc 1 do (t = t + j * 2.25)) : if t > b then (t - f%d(a, b)) else (t);\n", i, i - 1); printf "%s", line; n += length(line)'
+  "$out/lexBench" "$corpus" $runs
+}
+
+keywordsBench() {
+  $cxx $cxxflags "$root/benchmarks/lexer/keywordBench.cpp" \
+    -o "$out/keywordBench"
+  "$out/keywordBench" $runs
+}
+
+scanBench() {
+  for scanners in simd scalar; do
+    flags=
+    [ $scanners = scalar ] && flags=-DLEXSCAN_SCALAR
+    $cxx $cxxflags $flags "$root/benchmarks/lexer/lexBench.cpp" \
+      "$root/src/lexer.cpp" "$root/src/lexScan.cpp" $ldflags \
+      -o "$out/lexBench-$scanners"
+  done
+
+  # Long comment blocks between short definitions.
+  generate comments 'i++; line = sprintf("# node %d: generated from the dataflow graph, inputs are folded\n# into the accumulator below; do not edit, regenerate instead.\n#   %d -> %d -> %d\ndef c%d(a) a + %d;\n", i, i, i + 1, i + 2, i, i); printf "%s", line; n += length(line)'
+  comments=$corpus
+  # Long identifiers and little else.
+  generate identifiers 'i++; line = sprintf("def accumulateWeightedSample%d(firstOperandValue, secondOperandValue) firstOperandValue + secondOperandValue * scaleFactorForIteration%d;\n", i, i); printf "%s", line; n += length(line)'
+  identifiers=$corpus
+
+  for corpus in $comments $identifiers; do
+    for scanners in simd scalar; do
+      echo "-- $scanners"
+      "$out/lexBench-$scanners" "$corpus" $runs
+    done
+  done
+}
+
+# The compiler itself, rebuilt when a source is newer than the last build.
+buildCompiler() {
+  if [ ! -x "$out/slc" ] || [ -n "$(find "$root/src" "$root/include" -newer "$out/slc")" ]; then
+    $cxx $cxxflags "$root"/src/*.cpp $ldflags -o "$out/slc"
+  fi
+}
+
+# Prints the wall time of one command in seconds, or how it failed.
+timeIt() {
+  start=$(date +%s%N)
+  status=0
+  "$@" > /dev/null || status=$?
+  end=$(date +%s%N)
+  if [ $status -ne 0 ]; then
+    echo "failed with exit status $status"
+    return
+  fi
+  echo "$(( (end - start) / 1000000 ))" | awk '{ printf "%.3f s", $1 / 1000 }'
+}
+
+# Prints the best of $runs wall times of one command, as timeIt does.
+bestOf() {
+  best=
+  n=0
+  while [ $n -lt $runs ]; do
+    t=$(timeIt "$@")
+    case $t in
+      failed*)
+        echo "$t"
+        return
+        ;;
+    esac
+    best=$(echo "$best ${t% s}" | awk '{ print (NF == 1 || $2 < $1) ? $NF : $1 }')
+    n=$((n + 1))
+  done
+  echo "$best s"
+}
+
+# The wrapper that measures peak memory, rebuilt when its source changes.
+buildMaxRss() {
+  if [ ! -x "$out/maxRss" ] || [ "$root/benchmarks/memory/maxRss.cpp" -nt "$out/maxRss" ]; then
+    $cxx -O2 "$root/benchmarks/memory/maxRss.cpp" -o "$out/maxRss"
+  fi
+}
+
+# Prints the peak resident set size of one run of a command, or how it
+# failed.
+maxRss() {
+  status=0
+  rss=$("$out/maxRss" "$@") || status=$?
+  if [ $status -ne 0 ]; then
+    echo "failed with exit status $status"
+    return
+  fi
+  echo "$rss"
+}
+
+# Runs a command with what the script prints (on stderr) thrown away.
+quiet() {
+  "$@" 2> /dev/null
+}
+
+# The runtime functions compiled scripts call, for linking AOT builds.
+buildRuntime() {
+  if [ ! -f "$out/runtime.o" ] || [ "$root/src/runtime.cpp" -nt "$out/runtime.o" ]; then
+    $cxx -O2 -c "$root/src/runtime.cpp" -o "$out/runtime.o"
+  fi
+}
+
+# Compiles a script to an object with the given flags and links it into
+# $out/aot:
+#   buildAot script.sl [slc flags...]
+buildAot() {
+  script=$1
+  shift
+  "$out/slc" "$script" -p noir -o "$out/aot.o" "$@" > /dev/null &&
+    ${CC:-cc} "$out/aot.o" "$out/runtime.o" -o "$out/aot"
+}
+
+# Runs the program buildAot linked. main returns a double, so its exit
+# status means nothing.
+runAot() {
+  "$out/aot" || true
+}
+
+# Compiles, links and runs a script, as buildAot and runAot.
+aot() {
+  buildAot "$@" && runAot
+}
+
+# Leaves in $fib a script printing fib($1).
+generateFib() {
+  fib="$out/fib$1.sl"
+  cat > "$fib" <<SL
+extern printd(x);
+def fib(n) if n < 2 then (n) else (fib(n - 1) + fib(n - 2));
+printd(fib($1));
+SL
+}
+
+codegenBench() {
+  buildCompiler
+
+  # One function whose body is a chain of nested var/in blocks, each
+  # reading the variable bound by the one outside it.
+  for depth in 2000 4000 8000 16000 32000; do
+    file="$out/nestedVar-$depth.sl"
+    awk -v depth=$depth 'BEGIN {
+      printf "def f(x) var v0 = x + 1 in "
+      for (i = 1; i < depth; i++) printf "var v%d = v%d + 1 in ", i, i - 1
+      printf "v%d;\n", depth - 1
+    }' > "$file"
+    echo "depth $depth: $(timeIt "$out/slc" -O0 "$file" -p noir -o "$out/nestedVar.o")"
+  done
+}
+
+# Writes $out/deep<shape>.sl, each nesting one kind of expression $depth
+# levels deep.
+generateDeep() {
+  awk -v d=$depth 'BEGIN {
+    printf "def f(x) "; for (i = 0; i < d; i++) printf "("
+    printf "x"; for (i = 0; i < d; i++) printf ")"; print ";\nf(1);"
+  }' > "$out/deepParen.sl"
+  awk -v d=$depth 'BEGIN {
+    printf "def g(x) x;\ndef f(x) "; for (i = 0; i < d; i++) printf "g("
+    printf "x"; for (i = 0; i < d; i++) printf ")"; print ";\nf(1);"
+  }' > "$out/deepCall.sl"
+  awk -v d=$depth 'BEGIN {
+    printf "def unary ~ (v) 0 - v;\ndef f(x) "
+    for (i = 0; i < d; i++) printf "~"; print "x;\nf(1);"
+  }' > "$out/deepUnary.sl"
+  awk -v d=$depth 'BEGIN {
+    printf "def f(x) x"; for (i = 0; i < d; i++) printf "+1"; print ";\nf(1);"
+  }' > "$out/deepChain.sl"
+  awk -v d=$depth 'BEGIN {
+    printf "def f(x) "; for (i = 0; i < d; i++) printf "x = "
+    print "1;\nf(1);"
+  }' > "$out/deepAssign.sl"
+}
+
+parseBench() {
+  buildCompiler
+  depth=${BENCH_DEPTH:-1000000}
+
+  generateDeep
+
+  # Parsing alone at full depth; a whole -O0 compile is dominated by the
+  # LLVM back end on a million-instruction function, so it runs at a tenth
+  # of that depth.
+  for shape in Paren Call Unary Chain Assign; do
+    echo "$shape x $depth, parse: $(timeIt "$out/slc" -fsyntax-only "$out/deep$shape.sl")"
+  done
+  depth=$((depth / 10))
+  generateDeep
+  for shape in Paren Call Unary Chain Assign; do
+    echo "$shape x $depth, -O0 compile: $(timeIt "$out/slc" -O0 "$out/deep$shape.sl" -p noir -o "$out/deep.o")"
+  done
+}
+
+# Heap allocations, time and AST node bytes of the front end alone and of an
+# -O0 build, on $BENCH_ALLOC_DEFS (default 100000) definitions.
+allocBench() {
+  sources=$(ls "$root"/src/*.cpp | grep -v '/driver\.cpp$')
+  $cxx $cxxflags "$root/benchmarks/memory/allocBench.cpp" $sources $ldflags \
+    -o "$out/allocBench"
+
+  generateDefs ${BENCH_ALLOC_DEFS:-100000}
+  quiet "$out/allocBench" "$defs" "$out/defs.o" | grep -v '^Wrote '
+}
+
+# Leaves in $chain a script of $1 definitions, each calling the one before
+# it, that runs the last one once.
+generateChain() {
+  chain="$out/chain$1.sl"
+  awk -v defs=$1 'BEGIN {
+    print "extern printd(x);"
+    print "def f0(x) x + 1;"
+    for (i = 1; i < defs; i++) printf "def f%d(x) f%d(x) + 1;\n", i, i - 1
+    printf "printd(f%d(0));\n", defs - 1
+  }' > "$chain"
+}
+
+# Leaves in $defs a file of $1 definitions, or $BENCH_DEFS (default 50000),
+# shaped like the generated sources we compile, each calling the one before
+# it.
+generateDefs() {
+  count=${1:-${BENCH_DEFS:-50000}}
+  defs="$out/defs$count.sl"
+  if [ ! -f "$defs" ]; then
+    awk -v count=$count 'BEGIN {
+      print "def f0(a, b) a + b;"
+      for (i = 1; i < count; i++) printf "def f%d(a, b) var t = a * 1.5 in (for j = 0 when j < b inc 1 do (t = t + j * 2.25)) : if t > b then (t - f%d(a, b)) else (t);\n", i, i - 1
+    }' > "$defs"
+  fi
+}
+
+# Whole-process wall time of a script under -run against compiling it,
+# linking it with cc and running the result.
+runBench() {
+  buildCompiler
+  buildRuntime
+
+  generateFib 27
+  echo "fib(27): AOT $(bestOf quiet aot "$fib"), -run $(bestOf quiet "$out/slc" -run "$fib" -p noir)"
+}
+
+# A program of $BENCH_LAZY_DEFS (default 10000) definitions of which only
+# the first 1% ever run: each calls the next only while its argument is
+# above zero, and the script calls f0(99). Definitions come last to first,
+# since a call may only name a function defined before it. Each mode gets
+# its wall time and its peak resident set size.
+lazyBench() {
+  buildCompiler
+  buildMaxRss
+  defs=${BENCH_LAZY_DEFS:-10000}
+
+  file="$out/lazy-$defs.sl"
+  awk -v defs=$defs 'BEGIN {
+    print "extern printd(x);"
+    printf "def f%d(x) 0;\n", defs - 1
+    for (i = defs - 2; i >= 0; i--)
+      printf "def f%d(x) if x > 0 then (f%d(x - 1)) else (0);\n", i, i + 1
+    print "printd(f0(99));"
+  }' > "$file"
+  for mode in -fsyntax-only -lazy -run; do
+    echo "$mode: $(bestOf quiet "$out/slc" $mode "$file" -p noir)," \
+      "max RSS $(maxRss "$out/slc" $mode "$file" -p noir)"
+  done
+}
+
+# -t 1000 against -run and against the baseline tier alone (a threshold
+# nothing reaches), on code that runs once, recursion, and a hot loop.
+tierBench() {
+  buildCompiler
+  never=1000000000000
+
+  generateChain 2000
+  echo "2000 chained definitions: -run $(bestOf quiet "$out/slc" -run "$chain" -p noir), -t 1000 $(bestOf quiet "$out/slc" -t 1000 "$chain" -p noir)"
+
+  generateFib 35
+  echo "fib(35): -run $(bestOf quiet "$out/slc" -run "$fib" -p noir), -t 1000 $(bestOf quiet "$out/slc" -t 1000 "$fib" -p noir), baseline only $(bestOf quiet "$out/slc" -t $never "$fib" -p noir)"
+
+  file="$out/loopCalls.sl"
+  cat > "$file" <<'SL'
+extern printd(x);
+def work(n) var s = 0 in (for i = 0 when i < n inc 1 do (s = s + i * 0.5)) : s;
+def calls(k) var t = 0 in (for j = 0 when j < k inc 1 do (t = t + work(100000))) : t;
+printd(calls(2000));
+SL
+  echo "2000 x 100k-iteration loop calls: -run $(bestOf quiet "$out/slc" -run "$file" -p noir), -t 1000 $(bestOf quiet "$out/slc" -t 1000 "$file" -p noir), baseline only $(bestOf quiet "$out/slc" -t $never "$file" -p noir)"
+}
+
+# Runs a command against an empty $cacheDir.
+coldCache() {
+  rm -rf "$cacheDir"
+  "$@"
+}
+
+# -run and -t 1000 on 2000 chained definitions, without -cache, filling an
+# empty cache, and reusing a full one; then what -cachesize 1 leaves.
+cacheBench() {
+  buildCompiler
+  cacheDir="$out/jitCache"
+
+  generateChain 2000
+  for mode in -run "-t 1000"; do
+    echo "$mode: no cache $(bestOf quiet "$out/slc" $mode "$chain" -p noir)," \
+      "cold $(bestOf quiet coldCache "$out/slc" $mode -cache "$cacheDir" "$chain" -p noir)," \
+      "warm $(bestOf quiet "$out/slc" $mode -cache "$cacheDir" "$chain" -p noir)"
+  done
+
+  rm -rf "$cacheDir"
+  quiet "$out/slc" -run -cache "$cacheDir" -cachesize 1 "$chain" -p noir > /dev/null
+  echo "-cachesize 1 leaves $(ls "$cacheDir" | wc -l) objects, $(cat "$cacheDir"/* | wc -c) bytes"
+}
+
+# Incremental -cache builds of the $defs file against a full build: filling
+# an empty cache, rebuilding it unchanged, and after editing one definition
+# in the middle.
+incrementalBench() {
+  buildCompiler
+  generateDefs
+  cacheDir="$out/aotCache"
+
+  edited="$out/defsEdited.sl"
+  awk -v mid=$((count / 2)) 'NR == mid + 1 { sub(/a \* 1\.5/, "a * 1.75") } { print }' \
+    "$defs" > "$edited"
+
+  echo "full build:  $(bestOf quiet "$out/slc" "$defs" -p noir -o "$out/defs.o")"
+  echo "empty cache: $(bestOf quiet coldCache "$out/slc" -cache "$cacheDir" "$defs" -p noir -o "$out/defs.o")"
+  echo "unchanged:   $(bestOf quiet "$out/slc" -cache "$cacheDir" "$defs" -p noir -o "$out/defs.o")"
+  # Only the first run after the edit misses; later ones find it cached.
+  rm -rf "$cacheDir"
+  quiet "$out/slc" -cache "$cacheDir" "$defs" -p noir -o "$out/defs.o" > /dev/null
+  echo "one edited:  $(timeIt quiet "$out/slc" -cache "$cacheDir" "$edited" -p noir -o "$out/defs.o")"
+}
+
+# Whole-file builds of the $defs file with -j lowering jobs ($BENCH_JOBS,
+# default "1 2 4 8 16 32" up to the number of cores, and the number of cores
+# itself). At -O0 the module pipeline and emission are cheapest, so the
+# lowering the jobs share makes up most of the time.
+jobsBench() {
+  buildCompiler
+  generateDefs
+
+  counts=${BENCH_JOBS:-}
+  if [ -z "$counts" ]; then
+    cores=$(nproc)
+    for jobs in 1 2 4 8 16 32; do
+      if [ $jobs -lt $cores ]; then
+        counts="$counts $jobs"
+      fi
+    done
+    counts="$counts $((cores < 32 ? cores : 32))"
+  fi
+
+  for jobs in $counts; do
+    echo "-j $jobs: $(bestOf quiet "$out/slc" -O0 -j $jobs "$defs" -p noir -o "$out/defs.o")"
+  done
+}
+
+# Whole-file builds of the $defs file at -O0, serially and with parsing on
+# a thread of its own (-pipeline).
+pipelineBench() {
+  buildCompiler
+  generateDefs
+
+  echo "serial:    $(bestOf quiet "$out/slc" -O0 "$defs" -p noir -o "$out/defs.o")"
+  echo "-pipeline: $(bestOf quiet "$out/slc" -O0 -pipeline "$defs" -p noir -o "$out/defs.o")"
+}
+
+# Whole-file builds of the $defs file into one object and split into
+# $BENCH_SPLIT (default "2 4 8") parts emitted on threads of their own.
+splitBench() {
+  buildCompiler
+  generateDefs
+
+  echo "one object: $(bestOf quiet "$out/slc" "$defs" -p noir -o "$out/defs.o")"
+  for parts in ${BENCH_SPLIT:-2 4 8}; do
+    echo "-split $parts: $(bestOf quiet "$out/slc" -split $parts "$defs" -p noir -o "$out/defs.o")"
+  done
+}
+
+# Runtime of three programs, and compile time of the $defs file, at each -O
+# level and with -Ofast-compile.
+olevelsBench() {
+  buildCompiler
+  buildRuntime
+  generateFib 40
+  generateDefs
+
+  # A 12000^2 nested loop calling small helpers.
+  loops="$out/helperLoops.sl"
+  cat > "$loops" <<'SL'
+extern printd(x);
+def sq(x) x * x;
+def inside(x, y, r) if sq(x) + sq(y) < sq(r) then (1) else (0);
+def loops(n) var c = 0 in (for x = 0 when x < n inc 1 do (for y = 0 when y < n inc 1 do (c = c + inside(x, y, n)))) : c;
+printd(loops(12000));
+SL
+  # User-defined operators in an 80M-iteration loop.
+  ops="$out/userOps.sl"
+  cat > "$ops" <<'SL'
+extern printd(x);
+def binary | 5 (a, b) if a then (1) else (if b then (1) else (0));
+def binary & 6 (a, b) if a then (if b then (1) else (0)) else (0);
+def ops(n) var c = 0 in (for i = 0 when i < n inc 1 do (c = c + (if i < 1000 | i > 3000 & i < 5000 then (1) else (0)))) : c;
+printd(ops(80000000));
+SL
+
+  for flag in -O0 -O1 -O2 -O3 -Os -Ofast-compile; do
+    buildAot "$fib" $flag
+    fibTime=$(bestOf quiet runAot)
+    buildAot "$loops" $flag
+    loopsTime=$(bestOf quiet runAot)
+    buildAot "$ops" $flag
+    opsTime=$(bestOf quiet runAot)
+    echo "$flag: fib(40) $fibTime, loops $loopsTime, ops $opsTime," \
+      "compile $(timeIt quiet "$out/slc" $flag "$defs" -p noir -o "$out/defs.o")"
+  done
+}
+
+# Runtime of each kernel in benchmarks/loops at -O0, with -Ofast-compile and
+# at -O2.
+loopsBench() {
+  buildCompiler
+  buildRuntime
+
+  for kernel in "$root"/benchmarks/loops/*.sl; do
+    times=
+    for flag in -O0 -Ofast-compile -O2; do
+      buildAot "$kernel" $flag
+      times="$times, $flag $(bestOf quiet runAot)"
+    done
+    echo "$(basename "$kernel" .sl):${times#,}"
+  done
+}
+
+# Runtime of the floating-point kernels at -O2, strict, with -ffast-math,
+# and with -ffast-math for the host CPU. reduce_fast opts in per definition
+# and so is only built strict.
+fastmathBench() {
+  buildCompiler
+  buildRuntime
+
+  for kernel in reduce reduce_fast invariant recur countdown lattice triangle; do
+    times=
+    for mode in strict -ffast-math native; do
+      case $mode in
+        strict) flags= ;;
+        -ffast-math) flags=-ffast-math ;;
+        native) flags="-ffast-math -mcpu=native" ;;
+      esac
+      [ $kernel = reduce_fast ] && [ $mode != strict ] && continue
+      buildAot "$root/benchmarks/loops/$kernel.sl" -O2 $flags
+      times="$times, $mode $(bestOf quiet runAot)"
+    done
+    echo "$kernel:${times#,}"
+  done
+}
+
+all="lexer keywords scan codegen parse alloc run lazy tier cache incremental"
+all="$all jobs pipeline split olevels loops fastmath"
+benchmarks=${*:-$all}
+for bench in $benchmarks; do
+  echo "== $bench"
+  ${bench}Bench
+done
@@ -1,13 +1,22 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
 #include "llvm/ExecutionEngine/Orc/Mangling.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "objectCache.h"
 
 namespace llvm {
 namespace orc {
@@ -16,20 +25,65 @@ class SimpleJIT {
   std::unique_ptr<ExecutionSession> execS;
   DataLayout DL;
   MangleAndInterner MAI;
+  // Null unless a cache directory was given.
+  std::unique_ptr<DiskObjectCache> baselineCache;
+  std::unique_ptr<DiskObjectCache> objectCache;
   RTDyldObjectLinkingLayer objectLayer;
+  IRCompileLayer baselineLayer;
   IRCompileLayer compileLayer;
   JITDylib &mainJD;
 
+  // Only set up once the first stub is defined.
+  std::unique_ptr<IndirectStubsManager> stubs;
+
+  // Only set up by enableLazyCompilation().
+  std::unique_ptr<LazyCallThroughManager> lazyCallThrough;
+  std::unique_ptr<CompileOnDemandLayer> lazyLayer;
+
+  static void handleLazyCallThroughError() {
+    fprintf(stderr, "LogError: Lazy compilation of a function failed\n");
+    exit(1);
+  }
+
+  static JITTargetMachineBuilder withOptLevel(JITTargetMachineBuilder JTMB,
+                                              CodeGenOpt::Level level) {
+    JTMB.setCodeGenOptLevel(level);
+    return JTMB;
+  }
+
+  // Objects only match when they were built for the same target machine,
+  // so that goes into every key next to the module hash.
+  static std::unique_ptr<DiskObjectCache> createCache(
+      StringRef dir, uint64_t maxBytes, const JITTargetMachineBuilder &JTMB,
+      StringRef optLevel) {
+    if (dir.empty()) {
+      return nullptr;
+    }
+
+    std::string salt = JTMB.getTargetTriple().str() + "|" + JTMB.getCPU() +
+                       "|" + JTMB.getFeatures().getString() + "|" +
+                       optLevel.str();
+    return std::make_unique<DiskObjectCache>(dir.str(), salt, maxBytes);
+  }
+
  public:
   SimpleJIT(std::unique_ptr<ExecutionSession> execS,
-            JITTargetMachineBuilder JTMB, DataLayout DL)
+            JITTargetMachineBuilder JTMB, DataLayout DL, StringRef cacheDir,
+            uint64_t cacheBytes)
       : execS(std::move(execS)),
         DL(std::move(DL)),
         MAI(*this->execS, this->DL),
+        baselineCache(createCache(cacheDir, cacheBytes, JTMB, "O0")),
+        objectCache(createCache(cacheDir, cacheBytes, JTMB, "O2")),
         objectLayer(*this->execS,
                     []() { return std::make_unique<SectionMemoryManager>(); }),
+        baselineLayer(*this->execS, objectLayer,
+                      std::make_unique<ConcurrentIRCompiler>(
+                          withOptLevel(JTMB, CodeGenOpt::None),
+                          baselineCache.get())),
         compileLayer(*this->execS, objectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
+                     std::make_unique<ConcurrentIRCompiler>(
+                         std::move(JTMB), objectCache.get())),
         mainJD(this->execS->createBareJITDylib("<main>")) {
     mainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
@@ -46,7 +100,10 @@ class SimpleJIT {
     }
   }
 
-  static Expected<std::unique_ptr<SimpleJIT>> create() {
+  // With a cacheDir, compiled objects are reused across runs; the directory
+  // is trimmed once it holds more than cacheBytes.
+  static Expected<std::unique_ptr<SimpleJIT>> create(
+      StringRef cacheDir = "", uint64_t cacheBytes = 0) {
     auto EPC = SelfExecutorProcessControl::Create();
     if (!EPC) {
       return EPC.takeError();
@@ -63,9 +120,30 @@ class SimpleJIT {
     }
 
     return std::make_unique<SimpleJIT>(std::move(execS), std::move(JTMB),
-                                       std::move(*DL));
+                                       std::move(*DL), cacheDir, cacheBytes);
   }
 
+  // Routes addLazyModule() through a CompileOnDemandLayer. Each function
+  // is then reached through a stub and compiled on its first call.
+  Error enableLazyCompilation() {
+    const Triple &TT = execS->getExecutorProcessControl().getTargetTriple();
+
+    auto LCTM = createLocalLazyCallThroughManager(
+        TT, *execS, pointerToJITTargetAddress(&handleLazyCallThroughError));
+    if (!LCTM) {
+      return LCTM.takeError();
+    }
+    lazyCallThrough = std::move(*LCTM);
+
+    lazyLayer = std::make_unique<CompileOnDemandLayer>(
+        *execS, compileLayer, *lazyCallThrough,
+        createLocalIndirectStubsManagerBuilder(TT));
+    lazyLayer->setPartitionFunction(CompileOnDemandLayer::compileRequested);
+    return Error::success();
+  }
+
+  bool isLazy() const { return lazyLayer != nullptr; }
+
   const DataLayout &getDataLayout() const { return DL; }
 
   JITDylib &getMainJITDylib() { return mainJD; }
@@ -78,9 +156,60 @@ class SimpleJIT {
     return compileLayer.add(RT, std::move(TSM));
   }
 
+  // Compiles with fast instruction selection and no codegen optimisation,
+  // for code that should start running as soon as possible.
+  Error addBaselineModule(ThreadSafeModule TSM,
+                          ResourceTrackerSP RT = nullptr) {
+    if (!RT) {
+      RT = mainJD.getDefaultResourceTracker();
+    }
+
+    return baselineLayer.add(RT, std::move(TSM));
+  }
+
+  // Adds a module whose functions are compiled when first called, or up
+  // front if lazy compilation has not been enabled.
+  Error addLazyModule(ThreadSafeModule TSM) {
+    if (!lazyLayer) {
+      return addModule(std::move(TSM));
+    }
+
+    return lazyLayer->add(mainJD, std::move(TSM));
+  }
+
   Expected<JITEvaluatedSymbol> lookup(StringRef name) {
     return execS->lookup({&mainJD}, MAI(name.str()));
   }
+
+  Error defineAbsolute(StringRef name, JITTargetAddress addr) {
+    return mainJD.define(absoluteSymbols(
+        {{MAI(name.str()),
+          JITEvaluatedSymbol(addr, JITSymbolFlags::Exported |
+                                       JITSymbolFlags::Callable)}}));
+  }
+
+  // Defines name as a stub that jumps to target. Callers bind to the stub,
+  // so updateStub() can later redirect them all at once.
+  Error defineStub(StringRef name, JITTargetAddress target) {
+    if (!stubs) {
+      stubs = createLocalIndirectStubsManagerBuilder(
+          execS->getExecutorProcessControl().getTargetTriple())();
+    }
+
+    if (auto err = stubs->createStub(
+            name, target,
+            JITSymbolFlags::Exported | JITSymbolFlags::Callable)) {
+      return err;
+    }
+
+    return mainJD.define(
+        absoluteSymbols({{MAI(name.str()), stubs->findStub(name, true)}}));
+  }
+
+  // Safe to call from any thread while the stub is in use.
+  Error updateStub(StringRef name, JITTargetAddress target) {
+    return stubs->updatePointer(name, target);
+  }
 };
 }  // namespace orc
 }  // namespace llvm
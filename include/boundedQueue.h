@@ -0,0 +1,54 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+// A fixed-capacity FIFO between a producer and a consumer thread. push()
+// blocks while the queue is full and pop() while it is empty; once the
+// producer calls close(), pop() drains what is left and then fails.
+template <typename T>
+class BoundedQueue {
+ private:
+  std::mutex lock;
+  std::condition_variable notFull;
+  std::condition_variable notEmpty;
+  std::deque<T> items;
+  size_t capacity;
+  bool closed = false;
+
+ public:
+  explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+  void push(T item) {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      notFull.wait(guard, [this]() { return items.size() < capacity; });
+      items.push_back(std::move(item));
+    }
+    notEmpty.notify_one();
+  }
+
+  bool pop(T &item) {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      notEmpty.wait(guard, [this]() { return closed || !items.empty(); });
+      if (items.empty()) {
+        return false;
+      }
+      item = std::move(items.front());
+      items.pop_front();
+    }
+    notFull.notify_one();
+    return true;
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      closed = true;
+    }
+    notEmpty.notify_one();
+  }
+};
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "JIT.h"
+#include "boundedQueue.h"
+#include "lexExtern.h"
+#include "objectCache.h"
+#include "operatorTable.h"
+#include "optimiser.h"
+#include "parser.h"
+#include "symbolTable.h"
+#include "tiering.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Target/TargetMachine.h"
+
+// Everything the command line controls.
+struct CompilerOptions {
+  std::string outFileName = "out.o";
+  std::string fileName;
+
+  bool enableDebug = false;
+  bool printDebug = false;
+  bool printIR = true;
+  bool runJIT = false;
+  bool lazyJIT = false;
+  uint64_t tierThreshold = 0;
+  std::string cacheDir;
+  uint64_t cacheLimitMB = 256;
+  unsigned jobs = 1;
+  unsigned splitParts = 1;
+  OptimizationLevel optLevel = OptimizationLevel::O2;
+  // Object builds run the whole-module pipeline, with its inlining, after
+  // every definition has had the function pipeline. -Ofast-compile turns it
+  // off, which costs far less on files with long call chains.
+  bool wholeModulePipeline = true;
+  RemarkFilter remarks;
+  // Fast-math flags on all floating-point arithmetic (-ffast-math).
+  bool fastMath = false;
+  // Object output only. "native" means the host CPU and its features.
+  std::string cpu = "generic";
+  std::string features;
+  // x86-64 ISA levels to multiversion hot functions for (-mversions).
+  std::vector<unsigned> isaLevels;
+  bool pipeline = false;
+  // Stop once the source has been parsed (-fsyntax-only).
+  bool syntaxOnly = false;
+};
+
+// The functions a compiled file defines and the ones it declares extern,
+// with their arities, for checks across the files of one build.
+struct FileInterface {
+  std::vector<std::pair<std::string, unsigned>> defined;
+  std::vector<std::pair<std::string, unsigned>> externs;
+};
+
+// A top-level item as the front end hands it to the back end.
+struct ParsedItem {
+  enum Kind { Definition, Extern, TopLevel } kind;
+  std::unique_ptr<FunctionAST> fn;
+  std::unique_ptr<PrototypeAST> proto;
+};
+
+// One compilation of one source, from lexing to the object file or the end
+// of the -run script. A session owns all of its state, so independent
+// sessions can run on separate threads of the same process.
+class CompilerSession {
+ private:
+  CompilerOptions options;
+
+  // Front end.
+  SymbolTable symbols;
+  Lexer lexer;
+  int curTok = 0;
+  OperatorTable operators;
+  PrototypeMap functionProtos;
+  unsigned registeredProtos = 0;
+  // Functions lowered without errors, and those declared extern.
+  DenseSet<Symbol> definedFunctions;
+  DenseSet<Symbol> declaredExterns;
+  // Receives the nodes of the definition currently being parsed.
+  ASTArena *astArena = nullptr;
+  // Node bytes of every definition parsed so far, summed over their arenas.
+  size_t astBytes = 0;
+
+  // With -pipeline, the front end runs on a thread of its own and passes
+  // what it parses to the back end through this queue. Until the queue is
+  // closed, the front end owns the lexer, the symbol table (the back end
+  // may still read spellings) and operator precedences; everything below
+  // belongs to the back end.
+  BoundedQueue<ParsedItem> *parsedItems = nullptr;
+  // Binary operators whose definitions the back end failed to lower, as
+  // handles for operators.undefineBinary(), waiting for the front end.
+  std::mutex rejectedOperatorsMutex;
+  std::vector<int> rejectedOperators;
+
+  // Back end. The tier manager goes before the JIT it compiles into.
+  std::unique_ptr<llvm::orc::SimpleJIT> theJIT;
+  std::unique_ptr<TierManager> theTiers;
+  GenerateCode codeGenerator;
+  std::unique_ptr<TargetMachine> objectTargetMachine;
+  // Runs the whole-module pipeline over finished modules.
+  std::unique_ptr<Optimiser> moduleOptimiser;
+  // The object or archive compile() wrote, once it has been written.
+  std::string writtenFile;
+
+  // Incremental AOT builds (-cache without -run): every definition becomes
+  // an object of its own, reused from the cache while its hash is
+  // unchanged, and the output is an archive of those objects.
+  std::unique_ptr<DiskObjectCache> aotCache;
+  std::string aotSalt;
+  std::vector<std::unique_ptr<MemoryBuffer>> aotObjects;
+  // Set once the first top-level expression has become main.
+  bool haveMainObject = false;
+
+  // Parallel whole-file builds (-j): definitions are parsed up front and
+  // lowered on worker threads once the whole file has been read. A binary
+  // operator whose definition fails there keeps its precedence; nothing is
+  // left to parse by then.
+  struct QueuedDefinition {
+    std::unique_ptr<FunctionAST> fn;
+    Symbol name;
+    unsigned order;
+    bool isTopLevel;
+    bool failed = false;
+  };
+  bool parallelBuild = false;
+  std::vector<QueuedDefinition> queuedDefinitions;
+
+  int getNextToken();
+  int getTokPrecedence();
+  ExprAST *parseNumberExpr();
+  ExprAST *parseParenExpr();
+  ExprAST *parsePrimary();
+  ExprAST *parseExpression();
+  ExprAST *parseIfExpr();
+  ExprAST *parseForExpr();
+  bool parseLoopHints(LoopHints &hints);
+  ExprAST *parseVarExpr();
+  std::unique_ptr<PrototypeAST> parseProtoype();
+  std::unique_ptr<FunctionAST> parseDefinition();
+  bool parseDefinitionAttributes(bool &fastMath);
+  std::unique_ptr<PrototypeAST> parseExtern();
+  std::unique_ptr<FunctionAST> parseTopLvlExpr();
+
+  void initialiseModule();
+  void registerPrototype(const PrototypeAST &p);
+  void addModuleToJIT(orc::ResourceTrackerSP RT = nullptr);
+  void runTopLvlExpr();
+  void addTieredDefinition(Function *F, unsigned tierId);
+
+  std::unique_ptr<TargetMachine> createTargetMachine();
+  TargetMachine *getObjectTargetMachine();
+  void optimiseModule(Module &M);
+  bool emitObject(Module &M, raw_pwrite_stream &dest);
+  void emitSplitObjects();
+  void writeObjectArchive(
+      const std::vector<std::unique_ptr<MemoryBuffer>> &objects);
+  void initialiseIncremental();
+  bool compileIncremental(FunctionAST &fn);
+
+  void queueDefinition(std::unique_ptr<FunctionAST> fn, bool isTopLevel);
+  void lowerQueuedRange(size_t begin, size_t end,
+                        SmallVector<char, 0> &bitcode);
+  void lowerQueuedDefinitions();
+
+  void dispatch(ParsedItem item);
+  void lower(ParsedItem item);
+  void rejectOperator(const PrototypeAST &p);
+  void undoRejectedOperators();
+  void lowerDefinition(std::unique_ptr<FunctionAST> fnAST);
+  void lowerExtern(std::unique_ptr<PrototypeAST> protoAST);
+  void lowerTopLvlExpr(std::unique_ptr<FunctionAST> fnAST);
+  void runPipelined();
+
+  bool genDefinition();
+  bool genExtern();
+  bool genTopLvlExpr();
+  void handleDefinition();
+  void handleExtern();
+  void handleTopLvlExpr();
+  void mainLoop();
+  void printALL();
+  void compileToObject();
+
+  friend class GenerateCode;
+
+ public:
+  explicit CompilerSession(CompilerOptions options);
+  ~CompilerSession();
+
+  bool openSource(const std::string &name) { return lexer.openSource(name); }
+
+  // Compiles the opened source to options.outFileName, or runs it with -run.
+  void compile();
+
+  const std::string &getWrittenFile() const { return writtenFile; }
+  FileInterface getInterface() const;
+  size_t getASTBytesAllocated() const { return astBytes; }
+};
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "compilerSession.h"
+
+// Builds several source files as one program. Each file is compiled by a
+// session of its own, up to options.jobs at a time, to an object named after
+// the file next to options.outFileName. The externs of every file are then
+// checked against the definitions of the others, and the objects are
+// combined into one archive in place of options.outFileName. Returns false
+// if a file failed to build or the files disagree.
+bool buildFiles(const CompilerOptions &options,
+                const std::vector<std::string> &files);
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// A perfect hash over a fixed set of spellings. The table has 2^Bits slots;
+// building it searches for a seed that gives every spelling its own slot, so
+// a lookup is one hash and at most one comparison. Around n^2 slots for n
+// spellings makes a seed easy to find.
+template <unsigned Bits>
+struct KeywordTable {
+  static constexpr unsigned size = 1u << Bits;
+
+  unsigned seed = 0;
+  int16_t slots[size] = {};
+
+  // Seeded FNV-1a over the spelling, keeping the top bits as the slot.
+  static constexpr unsigned hash(const char *str, size_t len, unsigned seed) {
+    unsigned h = seed;
+    for (size_t i = 0; i < len; i++) {
+      h = (h ^ (unsigned char)str[i]) * 16777619u;
+    }
+    return h >> (32 - Bits);
+  }
+
+  // Index of the entry spelled str, or -1. spelling(i) gives the spelling
+  // of entry i in the list the table was built from.
+  template <typename Spelling>
+  constexpr int find(const char *str, size_t len, Spelling spelling) const {
+    int idx = slots[hash(str, len, seed)];
+    if (idx >= 0 && spelling(idx) == std::string_view(str, len)) {
+      return idx;
+    }
+    return -1;
+  }
+};
+
+// Builds the table for count entries, where spelling(i) is the spelling of
+// entry i. The result has seed 0 if no seed in the search range works; grow
+// Bits in that case.
+template <unsigned Bits, typename Spelling>
+constexpr KeywordTable<Bits> buildKeywordTable(size_t count,
+                                               Spelling spelling) {
+  for (unsigned seed = 2166136261u; seed != 2166136261u + 4096; seed++) {
+    KeywordTable<Bits> table;
+    table.seed = seed;
+    for (auto &slot : table.slots) {
+      slot = -1;
+    }
+
+    bool perfect = true;
+    for (size_t i = 0; i < count && perfect; i++) {
+      std::string_view word = spelling(i);
+      unsigned h = KeywordTable<Bits>::hash(word.data(), word.size(), seed);
+      if (table.slots[h] != -1) {
+        perfect = false;
+      } else {
+        table.slots[h] = (int16_t)i;
+      }
+    }
+
+    if (perfect) {
+      return table;
+    }
+  }
+  return KeywordTable<Bits>();
+}
@@ -1,6 +1,10 @@
-#include <map>
+#pragma once
+
+#include <memory>
 #include <string>
-#include <fstream>
+
+#include "llvm/Support/MemoryBuffer.h"
+#include "symbolTable.h"
 
 enum Token
 {
@@ -20,23 +24,69 @@ enum Token
 	tok_unary = -14,
 	tok_var = -15,
 	tok_in = -16,
+
+	// Two-character operators.
+	tok_le = -17,
+	tok_ge = -18,
+	tok_eq = -19,
+	tok_ne = -20,
+	tok_and = -21,
+	tok_or = -22,
 };
 
+// Whether a token is one of the two-character operators.
+inline bool isOperatorToken(int tok) { return tok <= tok_le && tok >= tok_or; }
+
+// How an operator is written in the source.
+inline std::string getOperatorSpelling(int op) {
+  switch (op) {
+    case tok_le:
+      return "<=";
+    case tok_ge:
+      return ">=";
+    case tok_eq:
+      return "==";
+    case tok_ne:
+      return "!=";
+    case tok_and:
+      return "&&";
+    case tok_or:
+      return "||";
+    default:
+      return std::string(1, (char)op);
+  }
+}
+
 struct SourceLocation
 {
   int line;
   int col;
 };
 
-extern double numVal;
-extern std::string identifierStr;
-extern char curTok;
-extern std::map<char, int> binOpPrecedence;
-extern SourceLocation curLoc;
-extern SourceLocation lexLoc;
-extern std::ifstream file;
-extern bool enableDebug;
-extern bool printDebug;
-extern bool printIR;
-extern std::string outFileName;
-extern std::string fileName;
+// Splits one source buffer into tokens. The whole input is held in one
+// contiguous buffer (mmapped for regular files, read in blocks for pipes and
+// stdin) and walked with a raw cursor. Identifiers are interned into the
+// symbol table the lexer was created with.
+class Lexer {
+ private:
+  SymbolTable &symbols;
+  std::unique_ptr<llvm::MemoryBuffer> sourceBuffer;
+  const char *curPtr = nullptr;
+  const char *bufEnd = nullptr;
+  SourceLocation lexLoc = {1, 0};
+
+  void skipWhitespace();
+
+ public:
+  // Value, spelling and position of the token last returned by getToken().
+  double numVal = 0;
+  // False when the number literal was malformed and has been reported.
+  bool numValid = true;
+  Symbol identifierSym = 0;
+  SourceLocation curLoc = {0, 0};
+
+  explicit Lexer(SymbolTable &symbols) : symbols(symbols) {}
+
+  bool openSource(const std::string &name);
+  int getToken();
+};
@@ -0,0 +1,14 @@
+#pragma once
+
+// Character-class scanners used by the lexer. Each returns the first
+// position in [ptr, end) that is not part of the run starting at ptr. The
+// SSE2/AVX2/scalar implementation is chosen once at startup from CPUID.
+
+// isspace()
+const char *scanWhitespace(const char *ptr, const char *end);
+// isalnum()
+const char *scanIdentifier(const char *ptr, const char *end);
+// isdigit() or '.'
+const char *scanNumber(const char *ptr, const char *end);
+// everything up to the next '\n' or '\r'
+const char *scanLineEnd(const char *ptr, const char *end);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Module.h"
+
+// Function multiversioning across the x86-64 ISA levels, for object output.
+// Functions that contain a loop stand in for the hot ones: every externally
+// visible one other than main gets a clone per requested level, compiled
+// for exactly that level's CPU and features whatever -mcpu and -mattr say,
+// and its name becomes an ifunc. The resolver checks the running CPU with
+// CPUID once, at load time, and picks the highest level it supports,
+// falling back to the original body, which is compiled for plain x86-64.
+// Needs an x86-64 ELF target.
+
+// Parses a comma-separated list such as "x86-64-v2,x86-64-v3" into ISA
+// levels (1 for plain x86-64). Returns false on an unknown name.
+bool parseIsaLevels(llvm::StringRef list, std::vector<unsigned> &levels);
+
+// Returns how many functions were versioned.
+unsigned multiversionFunctions(llvm::Module &M,
+                               llvm::ArrayRef<unsigned> levels);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+// Keeps compiled objects in a directory across runs. As an ObjectCache for
+// the JIT, an object is keyed on the SHA1 of the module's bitcode as it
+// reaches the code generator, less its name and source file name, plus a
+// salt describing the target machine (triple, CPU, features, opt level).
+// Incremental AOT builds use lookup() and store() with keys of their own.
+// Entries are evicted least recently used first, by file modification time,
+// once the directory holds more than maxBytes of objects.
+class DiskObjectCache : public llvm::ObjectCache {
+ private:
+  std::string dir;
+  std::string salt;
+  uint64_t maxBytes;
+
+  std::mutex lock;
+  uint64_t totalBytes = 0;
+
+  std::string getKey(const llvm::Module *M);
+  std::string getPath(llvm::StringRef key);
+  void evict();
+
+ public:
+  DiskObjectCache(std::string dir, std::string salt, uint64_t maxBytes);
+
+  void notifyObjectCompiled(const llvm::Module *M,
+                            llvm::MemoryBufferRef obj) override;
+  std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override;
+
+  std::unique_ptr<llvm::MemoryBuffer> lookup(llvm::StringRef key);
+  void store(llvm::StringRef key, llvm::MemoryBufferRef obj);
+};
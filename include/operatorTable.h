@@ -0,0 +1,138 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+#include "lexExtern.h"
+#include "llvm/IR/Function.h"
+#include "symbolTable.h"
+
+// Stands for "no function" in OperatorInfo.
+constexpr Symbol noOperatorFn = ~(Symbol)0;
+
+// What the parser and codegen need to know about one operator character.
+// A precedence of 0 means the character is not a binary operator.
+struct OperatorInfo {
+  // Parse-time properties, only touched by the thread that parses.
+  unsigned char precedence;
+  bool rightAssoc;
+  // The functions implementing the operator, by name and in the current
+  // module, only touched by the thread that lowers.
+  Symbol binaryName;
+  Symbol unaryName;
+  llvm::Function *binaryFn;
+  llvm::Function *unaryFn;
+};
+
+// Whether the code generator implements a binary operator itself. These
+// cannot be redefined.
+inline bool isBuiltinBinaryOp(int op) {
+  return op == ':' || op == '=' || op == '<' || op == '>' || op == '+' ||
+         op == '-' || op == '*' || isOperatorToken(op);
+}
+
+// The operator slots with only the built-in binary operators defined,
+// worked out at compile time.
+constexpr std::array<OperatorInfo, 256> makeBuiltinOperators() {
+  std::array<OperatorInfo, 256> entries{};
+  for (OperatorInfo &info : entries) {
+    info = {0, false, noOperatorFn, noOperatorFn, nullptr, nullptr};
+  }
+  entries[(unsigned char)':'].precedence = 1;
+  entries[(unsigned char)'='].precedence = 2;
+  entries[(unsigned char)'='].rightAssoc = true;
+  entries[(unsigned char)tok_or].precedence = 5;
+  entries[(unsigned char)tok_and].precedence = 6;
+  entries[(unsigned char)tok_eq].precedence = 8;
+  entries[(unsigned char)tok_ne].precedence = 8;
+  entries[(unsigned char)'<'].precedence = 10;
+  entries[(unsigned char)'>'].precedence = 10;
+  entries[(unsigned char)tok_le].precedence = 10;
+  entries[(unsigned char)tok_ge].precedence = 10;
+  entries[(unsigned char)'+'].precedence = 20;
+  entries[(unsigned char)'-'].precedence = 20;
+  entries[(unsigned char)'*'].precedence = 40;
+  return entries;
+}
+
+// Operators indexed directly by their token byte. A two-character operator
+// uses the low byte of its token (0xEA-0xEF); source bytes with those values
+// map to the same slots, but the parser only accepts ASCII characters as
+// operators, so nothing else ever reads or defines them. A table starts as a
+// copy of the compile-time built-in table; a user-defined binary operator
+// gets its precedence as soon as its definition has been parsed, and loses
+// it again if that definition then fails to lower. The cached Function
+// pointers refer to the current module; they are dropped if that function
+// is erased and all of them are forgotten when a new module is started.
+class OperatorTable {
+ private:
+  static constexpr std::array<OperatorInfo, 256> builtins =
+      makeBuiltinOperators();
+
+  // One defineBinary() call and what it replaced, kept so the definition
+  // can be taken back later.
+  struct Definition {
+    char op;
+    unsigned char precedence;
+    unsigned char previousPrecedence;
+    bool previousRightAssoc;
+    bool undone;
+  };
+
+  std::array<OperatorInfo, 256> entries = builtins;
+  // Every defineBinary() so far, oldest first.
+  std::vector<Definition> definitions;
+
+ public:
+  OperatorInfo &operator[](int op) { return entries[(unsigned char)op]; }
+
+  const OperatorInfo &operator[](int op) const {
+    return entries[(unsigned char)op];
+  }
+
+  // Returns the handle undefineBinary() takes.
+  size_t defineBinary(char op, unsigned precedence) {
+    OperatorInfo &info = (*this)[op];
+    definitions.push_back(
+        {op, (unsigned char)precedence, info.precedence, info.rightAssoc,
+         false});
+    info.precedence = (unsigned char)precedence;
+    info.rightAssoc = false;
+    return definitions.size() - 1;
+  }
+
+  // Takes back one definition of a binary operator. The operator keeps the
+  // precedence of its latest definition that still stands, or goes back to
+  // what it had before the first one.
+  void undefineBinary(size_t handle) {
+    char op = definitions[handle].op;
+    definitions[handle].undone = true;
+
+    OperatorInfo &info = (*this)[op];
+    for (size_t i = definitions.size(); i-- > 0;) {
+      const Definition &def = definitions[i];
+      if (def.op != op) {
+        continue;
+      }
+      if (!def.undone) {
+        info.precedence = def.precedence;
+        info.rightAssoc = false;
+        return;
+      }
+      info.precedence = def.previousPrecedence;
+      info.rightAssoc = def.previousRightAssoc;
+    }
+  }
+
+  void nameBinary(char op, Symbol fn) { (*this)[op].binaryName = fn; }
+
+  void nameUnary(char op, Symbol fn) { (*this)[op].unaryName = fn; }
+
+  void forgetFunctions() {
+    for (OperatorInfo &info : entries) {
+      info.binaryFn = nullptr;
+      info.unaryFn = nullptr;
+    }
+  }
+};
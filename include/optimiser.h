@@ -0,0 +1,76 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Target/TargetMachine.h"
+
+// Loop metadata property recording where a hinted loop starts in the
+// source, as {line, column}, so remarks can point at it without debug info.
+constexpr const char *loopLocationTag = "sl.loop.location";
+
+// Which optimisation remarks to print, as regular expressions over pass
+// names, like clang's -Rpass, -Rpass-missed and -Rpass-analysis. An empty
+// pattern turns that kind of remark off.
+struct RemarkFilter {
+  std::string passed;
+  std::string missed;
+  std::string analysis;
+};
+
+// The standard pipelines of one -O level, on the new pass manager.
+// runOnFunction() is meant for each definition as soon as it is lowered: it
+// promotes allocas to registers first, so the passes after it see SSA
+// values, then runs the function simplification pipeline.
+// runOnModule() runs the whole default pipeline, with inlining, IPO and the
+// loop passes, over a finished module, which object builds get unless
+// -Ofast-compile is given. At -O0 neither does anything beyond
+// what the O0 pipeline requires. Remarks the filter selects, and warnings
+// about loop hints the passes could not honour, go to stderr while either
+// runs. An Optimiser is used by one thread at a time.
+class Optimiser {
+ private:
+  llvm::OptimizationLevel level;
+
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+  llvm::PassBuilder PB;
+
+  llvm::FunctionPassManager FPM;
+
+  // Compiled RemarkFilter patterns; null for the kinds that are off.
+  std::unique_ptr<llvm::Regex> passedRemarks;
+  std::unique_ptr<llvm::Regex> missedRemarks;
+  std::unique_ptr<llvm::Regex> analysisRemarks;
+
+  void clearAnalyses();
+  bool remarksEnabled() const;
+  void withRemarks(llvm::LLVMContext &context,
+                   llvm::function_ref<void()> run);
+
+ public:
+  // Without a target machine, the passes fall back to generic cost models.
+  explicit Optimiser(llvm::OptimizationLevel level,
+                     llvm::TargetMachine *TM = nullptr,
+                     const RemarkFilter &remarks = RemarkFilter());
+
+  void runOnFunction(llvm::Function &F);
+  void runOnModule(llvm::Module &M);
+};
+
+// The code generator's optimisation level for an -O level.
+llvm::CodeGenOpt::Level getCodeGenOptLevel(llvm::OptimizationLevel level);
+
+// "O2", "Os" and so on, for cache keys.
+std::string getOptLevelName(llvm::OptimizationLevel level);
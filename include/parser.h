@@ -3,11 +3,18 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include "../include/lexExtern.h"
+#include "../include/operatorTable.h"
+#include "../include/optimiser.h"
+#include "../include/scopeStack.h"
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Analysis/BasicAliasAnalysis.h"
 #include "llvm/Analysis/Passes.h"
@@ -24,16 +31,14 @@
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Casting.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Host.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-#include "llvm/Transforms/Utils.h"
 
 using namespace llvm;
 
@@ -54,38 +59,143 @@ class FunctionAST;
 class IfExprAST;
 class ForExprAST;
 class GenerateCode;
+class CompilerSession;
+struct CompilerOptions;
+
+// Every prototype seen so far, by function name.
+typedef DenseMap<Symbol, std::unique_ptr<PrototypeAST>> PrototypeMap;
 
 static raw_ostream& indent(raw_ostream& O, int size) {
   return O << std::string(size, ' ');
 }
 
+struct DebugInfo {
+  DICompileUnit* theCU = nullptr;
+  DIType* doubleType = nullptr;
+  std::vector<DIScope*> lexicalBlocks;
+};
+
+// Lowers definitions into the module under construction. Each instance owns
+// its LLVM context, module, builder and pass manager, and reads the symbols
+// and prototypes of the session it belongs to. The operator table also
+// caches Function pointers into the module, so parallel workers bring their
+// own copy.
 class GenerateCode {
+ private:
+  const CompilerOptions& options;
+  const SymbolTable& symbols;
+  OperatorTable& operators;
+  const PrototypeMap& functionProtos;
+
+  // Prototypes registered after this position are not visible yet.
+  unsigned lastVisibleProto = ~0u;
+
+  std::unique_ptr<IRBuilder<>> Builder;
+  std::unique_ptr<Optimiser> optimiser;
+  std::unique_ptr<DIBuilder> DBuilder;
+  ScopeStack namedValues;
+  DebugInfo debugInfo;
+
+  AllocaInst* createEntryBlockAlloca(Function* theFunction, StringRef varName);
+  DISubroutineType* createFunctionType(unsigned numArgs);
+  DIType* getDebugDoubleTy();
+  void emitLocation(ExprAST* AST);
+  Function* getFunction(Symbol name);
+
+  Value* emitAssignment(BinaryExprAST*, Value* val);
+  Value* emitBinaryOp(BinaryExprAST*, Value* L, Value* R);
+  Value* emitUnaryOp(UnaryExprAST*, Value* operand);
+  Value* emitComparison(int op, Value* L, Value* R);
+  Value* emitLogicalValue(BinaryExprAST*);
+  bool emitBranch(ExprAST* cond, BasicBlock* trueBB, BasicBlock* falseBB);
+  void adoptBlocks(Function* theFunction, ArrayRef<BasicBlock*> blocks);
+  void emitTierCount();
+  MDNode* createLoopID(ForExprAST& a);
+
+  // Counter id of the definition being lowered for tiered execution, or -1.
+  int tierCounterId = -1;
+
  public:
+  // The module being built and the context that owns it. Moving them out
+  // hands the module over; startModule() must run before the next one.
+  std::unique_ptr<LLVMContext> theContext;
+  std::unique_ptr<Module> theModule;
+
+  explicit GenerateCode(CompilerSession& session);
+  GenerateCode(CompilerSession& session, OperatorTable& operators);
+  ~GenerateCode();
+
+  void startModule(const DataLayout& DL);
+  void initializeDwarf(StringRef fileName);
+  void finalizeDwarf();
+
+  void setTierCounter(int id) { tierCounterId = id; }
+
+  // Lowering a definition out of order, calls may only resolve to the
+  // prototypes registered up to and including its own.
+  void setVisiblePrototypes(unsigned order) { lastVisibleProto = order; }
+
   Value* codegen(NumberExprAST*);
   Value* codegen(VariableExprAST*);
   Value* codegen(VarExprAST*);
   Value* codegen(ExprAST*);
-  Value* codegen(BinaryExprAST*);
-  Value* codegen(UnaryExprAST*);
-  Value* codegen(CallExprAST*);
   Value* codegen(IfExprAST*);
   Value* codegen(ForExprAST*);
   Function* Codegen(FunctionAST*);
   Function* Codegen(PrototypeAST*);
 };
 
+// Storage for the expression nodes of one top-level definition. Nodes are
+// trivially destructible and are released together, in bulk, with the
+// arena once the definition has been lowered.
+class ASTArena {
+ private:
+  BumpPtrAllocator allocator;
+
+ public:
+  template <typename T, typename... Args>
+  T* create(Args&&... args) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "arena nodes are never destroyed individually");
+    return new (allocator.Allocate<T>()) T(std::forward<Args>(args)...);
+  }
+
+  template <typename T>
+  ArrayRef<T> copy(ArrayRef<T> items) {
+    T* mem = allocator.Allocate<T>(items.size());
+    std::uninitialized_copy(items.begin(), items.end(), mem);
+    return ArrayRef<T>(mem, items.size());
+  }
+
+  size_t getBytesAllocated() const { return allocator.getBytesAllocated(); }
+};
+
 class ExprAST {
+ public:
+  enum ExprKind : unsigned char {
+    EK_Number,
+    EK_Variable,
+    EK_Var,
+    EK_Binary,
+    EK_Unary,
+    EK_Call,
+    EK_If,
+    EK_For,
+  };
+
+ private:
+  const ExprKind kind;
+
  public:
   SourceLocation loc;
 
  public:
-  ExprAST(SourceLocation loc = curLoc) : loc(loc) {}
-  virtual ~ExprAST() = default;
-  virtual Value* codegen(GenerateCode* codeGenerator) {}
-  virtual Function* Codegen(GenerateCode* codeGenerator) {}
+  ExprAST(ExprKind kind, SourceLocation loc) : kind(kind), loc(loc) {}
+  ExprKind getKind() const { return kind; }
   int getLine() const { return loc.line; }
   int getCol() const { return loc.col; }
-  virtual raw_ostream& dump(raw_ostream& out, int ind) {
+  raw_ostream& dump(raw_ostream& out, int ind, const SymbolTable& symbols);
+  raw_ostream& dumpLoc(raw_ostream& out, int ind) {
     return out << ':' << getLine() << ':' << getCol() << '\n';
   }
 };
@@ -95,210 +205,279 @@ class NumberExprAST : public ExprAST {
   double val;
 
  public:
-  NumberExprAST(double val) : val(val) {}
-  Value* codegen(GenerateCode* codeGenerator) override {
-    return codeGenerator->codegen(this);
-  }
-  raw_ostream& dump(raw_ostream& out, int ind) override {
-    return ExprAST::dump(out << val, ind);
-  }
+  NumberExprAST(SourceLocation loc, double val)
+      : ExprAST(EK_Number, loc), val(val) {}
+  static bool classof(const ExprAST* e) { return e->getKind() == EK_Number; }
 };
 
 class VariableExprAST : public ExprAST {
  public:
-  std::string name;
+  Symbol name;
 
  public:
-  VariableExprAST(SourceLocation loc, const std::string& name)
-      : ExprAST(loc), name(name) {}
-  Value* codegen(GenerateCode* codeGenerator) override {
-    return codeGenerator->codegen(this);
-  }
-  raw_ostream& dump(raw_ostream& out, int ind) override {
-    return ExprAST::dump(out << name, ind);
-  }
+  VariableExprAST(SourceLocation loc, Symbol name)
+      : ExprAST(EK_Variable, loc), name(name) {}
+  static bool classof(const ExprAST* e) { return e->getKind() == EK_Variable; }
+};
+
+struct VarBinding {
+  Symbol name;
+  ExprAST* init;
 };
 
 class VarExprAST : public ExprAST {
  public:
-  std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> vars;
-  std::unique_ptr<ExprAST> body;
+  ArrayRef<VarBinding> vars;
+  ExprAST* body;
 
  public:
-  VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> vars,
-             std::unique_ptr<ExprAST> body)
-      : vars(std::move(vars)), body(std::move(body)) {}
-  Value* codegen(GenerateCode* codeGenerator) override {
-    return codeGenerator->codegen(this);
-  }
-  raw_ostream& dump(raw_ostream& out, int ind) override {
-    ExprAST::dump(out << "var", ind);
-    for (const auto& namedVar : vars) {
-      namedVar.second->dump(indent(out, ind) << namedVar.first << ':', ind + 1);
-    }
-    body->dump(indent(out, ind) << "Body:", ind + 1);
-    return out;
-  }
+  VarExprAST(SourceLocation loc, ArrayRef<VarBinding> vars, ExprAST* body)
+      : ExprAST(EK_Var, loc), vars(vars), body(body) {}
+  static bool classof(const ExprAST* e) { return e->getKind() == EK_Var; }
 };
 
 class BinaryExprAST : public ExprAST {
  public:
-  char op;
-  std::unique_ptr<ExprAST> LHS, RHS;
+  // A character, or the token of a two-character operator.
+  int op;
+  ExprAST *LHS, *RHS;
 
  public:
-  BinaryExprAST(SourceLocation loc, char op, std::unique_ptr<ExprAST> LHS,
-                std::unique_ptr<ExprAST> RHS)
-      : ExprAST(loc), op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-  Value* codegen(GenerateCode* codeGenerator) override {
-    return codeGenerator->codegen(this);
-  }
-  raw_ostream& dump(raw_ostream& out, int ind) override {
-    ExprAST::dump(out << "binary" << op, ind);
-    LHS->dump(indent(out, ind) << "LHS:", ind + 1);
-    RHS->dump(indent(out, ind) << "RHS:", ind + 1);
-    return out;
-  }
+  BinaryExprAST(SourceLocation loc, int op, ExprAST* LHS, ExprAST* RHS)
+      : ExprAST(EK_Binary, loc), op(op), LHS(LHS), RHS(RHS) {}
+  static bool classof(const ExprAST* e) { return e->getKind() == EK_Binary; }
 };
 
 class UnaryExprAST : public ExprAST {
  public:
   char op;
-  std::unique_ptr<ExprAST> operand;
+  ExprAST* operand;
 
  public:
-  UnaryExprAST(char op, std::unique_ptr<ExprAST> operand)
-      : op(op), operand(std::move(operand)) {}
-  Value* codegen(GenerateCode* codeGenerator) override {
-    return codeGenerator->codegen(this);
-  }
-  raw_ostream& dump(raw_ostream& out, int ind) override {
-    ExprAST::dump(out << "unary" << op, ind);
-    operand->dump(out, ind + 1);
-    return out;
-  }
+  UnaryExprAST(SourceLocation loc, char op, ExprAST* operand)
+      : ExprAST(EK_Unary, loc), op(op), operand(operand) {}
+  static bool classof(const ExprAST* e) { return e->getKind() == EK_Unary; }
 };
 
 class CallExprAST : public ExprAST {
  public:
-  std::string callee;
-  std::vector<std::unique_ptr<ExprAST>> args;
+  Symbol callee;
+  ArrayRef<ExprAST*> args;
 
  public:
-  CallExprAST(SourceLocation loc, const std::string& callee,
-              std::vector<std::unique_ptr<ExprAST>> args)
-      : ExprAST(loc), callee(callee), args(std::move(args)) {}
-  Value* codegen(GenerateCode* codeGenerator) override {
-    return codeGenerator->codegen(this);
+  CallExprAST(SourceLocation loc, Symbol callee, ArrayRef<ExprAST*> args)
+      : ExprAST(EK_Call, loc), callee(callee), args(args) {}
+  static bool classof(const ExprAST* e) { return e->getKind() == EK_Call; }
+};
+
+class IfExprAST : public ExprAST {
+ public:
+  ExprAST *cond, *then, *_else;
+
+ public:
+  IfExprAST(SourceLocation loc, ExprAST* cond, ExprAST* then, ExprAST* _else)
+      : ExprAST(EK_If, loc), cond(cond), then(then), _else(_else) {}
+  static bool classof(const ExprAST* e) { return e->getKind() == EK_If; }
+};
+
+// What a loop asks of the loop optimisers, written in brackets after for:
+// `for [unroll 4, vectorize 8, interleave 2] i = ...`, or `novectorize`.
+// Zero means no request.
+struct LoopHints {
+  unsigned unrollCount = 0;
+  unsigned vectorizeWidth = 0;
+  unsigned interleaveCount = 0;
+  bool noVectorize = false;
+
+  bool empty() const {
+    return !unrollCount && !vectorizeWidth && !interleaveCount && !noVectorize;
   }
-  raw_ostream& dump(raw_ostream& out, int ind) override {
-    ExprAST::dump(out << "call " << callee, ind + 1);
-    for (const auto& arg : args) {
-      arg->dump(indent(out, ind + 1), ind + 1);
+};
+
+class ForExprAST : public ExprAST {
+ public:
+  Symbol varName;
+  ExprAST *start, *cond, *step, *body;
+  LoopHints hints;
+
+ public:
+  ForExprAST(SourceLocation loc, Symbol varName, ExprAST* start, ExprAST* cond,
+             ExprAST* step, ExprAST* body, LoopHints hints)
+      : ExprAST(EK_For, loc),
+        varName(varName),
+        start(start),
+        cond(cond),
+        step(step),
+        body(body),
+        hints(hints) {}
+  static bool classof(const ExprAST* e) { return e->getKind() == EK_For; }
+};
+
+// Prints the tree with an explicit stack so that arbitrarily deep
+// expressions can be dumped.
+inline raw_ostream& ExprAST::dump(raw_ostream& out, int ind,
+                                  const SymbolTable& symbols) {
+  struct Pending {
+    ExprAST* node;
+    int ind;
+    int labelInd;  // -1 when the node continues the current line
+    StringRef label, labelSuffix;
+
+    Pending(ExprAST* node, int ind, int labelInd, StringRef label = "",
+            StringRef labelSuffix = "")
+        : node(node),
+          ind(ind),
+          labelInd(labelInd),
+          label(label),
+          labelSuffix(labelSuffix) {}
+  };
+
+  SmallVector<Pending, 16> work;
+  work.push_back({this, ind, -1});
+
+  while (!work.empty()) {
+    Pending item = work.pop_back_val();
+    if (item.labelInd >= 0) {
+      indent(out, item.labelInd) << item.label << item.labelSuffix;
+    }
+
+    ExprAST* e = item.node;
+    int ind = item.ind;
+    if (!e) {
+      out << "0\n";
+      continue;
+    }
+
+    switch (e->getKind()) {
+      case EK_Number:
+        e->dumpLoc(out << cast<NumberExprAST>(e)->val, ind);
+        break;
+      case EK_Variable:
+        e->dumpLoc(out << symbols.str(cast<VariableExprAST>(e)->name), ind);
+        break;
+      case EK_Var: {
+        auto* a = cast<VarExprAST>(e);
+        e->dumpLoc(out << "var", ind);
+        work.push_back({a->body, ind + 1, ind, "Body:"});
+        for (const auto& namedVar : llvm::reverse(a->vars)) {
+          work.push_back(
+              {namedVar.init, ind + 1, ind, symbols.str(namedVar.name), ":"});
+        }
+        break;
+      }
+      case EK_Binary: {
+        auto* a = cast<BinaryExprAST>(e);
+        e->dumpLoc(out << "binary" << getOperatorSpelling(a->op), ind);
+        work.push_back({a->RHS, ind + 1, ind, "RHS:"});
+        work.push_back({a->LHS, ind + 1, ind, "LHS:"});
+        break;
+      }
+      case EK_Unary: {
+        auto* a = cast<UnaryExprAST>(e);
+        e->dumpLoc(out << "unary" << a->op, ind);
+        work.push_back({a->operand, ind + 1, -1});
+        break;
+      }
+      case EK_Call: {
+        auto* a = cast<CallExprAST>(e);
+        e->dumpLoc(out << "call " << symbols.str(a->callee), ind + 1);
+        for (ExprAST* arg : llvm::reverse(a->args)) {
+          work.push_back({arg, ind + 1, ind + 1});
+        }
+        break;
+      }
+      case EK_If: {
+        auto* a = cast<IfExprAST>(e);
+        e->dumpLoc(out << "if", ind);
+        work.push_back({a->_else, ind + 1, ind, "else:"});
+        work.push_back({a->then, ind + 1, ind, "then:"});
+        work.push_back({a->cond, ind + 1, ind, "condition:"});
+        break;
+      }
+      case EK_For: {
+        auto* a = cast<ForExprAST>(e);
+        out << "for";
+        if (a->hints.unrollCount) out << " unroll " << a->hints.unrollCount;
+        if (a->hints.vectorizeWidth) {
+          out << " vectorize " << a->hints.vectorizeWidth;
+        }
+        if (a->hints.interleaveCount) {
+          out << " interleave " << a->hints.interleaveCount;
+        }
+        if (a->hints.noVectorize) out << " novectorize";
+        e->dumpLoc(out, ind);
+        work.push_back({a->body, ind + 1, ind, "body:"});
+        if (a->step) {
+          work.push_back({a->step, ind + 1, ind, "increment:"});
+        }
+        work.push_back({a->cond, ind + 1, ind, "condition:"});
+        work.push_back({a->start, ind + 1, ind, "initialization:"});
+        break;
+      }
     }
-    return out;
   }
-};
+  return out;
+}
 
-class PrototypeAST : public ExprAST {
+// Prototypes outlive the definition they came from (they are kept in
+// functionProtos), so they are heap objects rather than arena nodes. They
+// keep the spelling of their name, which lives in the session's symbol table.
+class PrototypeAST {
  public:
-  std::string name;
-  std::vector<std::unique_ptr<ExprAST>> args;
-  std::vector<std::string> argString;
+  Symbol name;
+  StringRef spelling;
+  std::vector<Symbol> argNames;
   bool isOperator;
   unsigned precedence;
   int line;
+  // Position among the prototypes registered by the session.
+  unsigned order = 0;
+  // Set for definitions written `def [fastmath] ...`.
+  bool fastMath = false;
+  // For a binary operator definition, what OperatorTable::defineBinary()
+  // returned when parsing gave it its precedence.
+  int precedenceHandle = -1;
 
  public:
-  PrototypeAST(SourceLocation loc, const std::string& name,
-               std::vector<std::unique_ptr<ExprAST>> args,
-               std::vector<std::string> argString, bool isOperator = false,
+  PrototypeAST(SourceLocation loc, Symbol name, StringRef spelling,
+               std::vector<Symbol> argNames, bool isOperator = false,
                unsigned precedence = 0)
       : name(name),
-        args(std::move(args)),
-        argString(std::move(argString)),
+        spelling(spelling),
+        argNames(std::move(argNames)),
         isOperator(isOperator),
         precedence(precedence),
         line(loc.line) {}
-  const std::string getName() const { return name; }
-  Function* Codegen(GenerateCode* codeGenerator) override {
+  StringRef getName() const { return spelling; }
+  Function* Codegen(GenerateCode* codeGenerator) {
     return codeGenerator->Codegen(this);
   }
-  bool isUnaryOp() { return (isOperator && (args.size() == 1)); }
-  bool isBinaryOp() { return (isOperator && (args.size() == 2)); }
-  char getOperatorName() {
+  bool isUnaryOp() const { return (isOperator && (argNames.size() == 1)); }
+  bool isBinaryOp() const { return (isOperator && (argNames.size() == 2)); }
+  char getOperatorName() const {
     assert(isUnaryOp() || isBinaryOp());
-    return name[name.size() - 1];
+    return getName().back();
   }
   int getLine() const { return line; }
 };
 
-class FunctionAST : public ExprAST {
+class FunctionAST {
  public:
   std::unique_ptr<PrototypeAST> proto;
-  std::unique_ptr<ExprAST> body;
+  ExprAST* body;
+  std::unique_ptr<ASTArena> arena;
 
  public:
-  FunctionAST(std::unique_ptr<PrototypeAST> proto,
-              std::unique_ptr<ExprAST> body)
-      : proto(std::move(proto)), body(std::move(body)) {}
-  Function* Codegen(GenerateCode* codeGenerator) override {
+  FunctionAST(std::unique_ptr<PrototypeAST> proto, ExprAST* body,
+              std::unique_ptr<ASTArena> arena)
+      : proto(std::move(proto)), body(body), arena(std::move(arena)) {}
+  Function* Codegen(GenerateCode* codeGenerator) {
     return codeGenerator->Codegen(this);
   }
-  raw_ostream& dump(raw_ostream& out, int ind) override {
+  raw_ostream& dump(raw_ostream& out, int ind, const SymbolTable& symbols) {
     indent(out, ind) << "Function:\n";
     ind++;
     indent(out, ind) << "Body:\n";
-    return body ? body->dump(out, ind) : out << "null\n";
-  }
-};
-
-class IfExprAST : public ExprAST {
- public:
-  std::unique_ptr<ExprAST> cond, then, _else;
-
- public:
-  IfExprAST(SourceLocation loc, std::unique_ptr<ExprAST> cond,
-            std::unique_ptr<ExprAST> then, std::unique_ptr<ExprAST> _else)
-      : ExprAST(loc),
-        cond(std::move(cond)),
-        then(std::move(then)),
-        _else(std::move(_else)) {}
-  Value* codegen(GenerateCode* codeGenerator) override {
-    return codeGenerator->codegen(this);
-  }
-  raw_ostream& dump(raw_ostream& out, int ind) override {
-    ExprAST::dump(out << "if", ind);
-    cond->dump(indent(out, ind) << "condition:", ind + 1);
-    then->dump(indent(out, ind) << "then:", ind + 1);
-    _else->dump(indent(out, ind) << "else:", ind + 1);
-    return out;
-  }
-};
-
-class ForExprAST : public ExprAST {
- public:
-  std::string varName;
-  std::unique_ptr<ExprAST> start, cond, step, body;
-
- public:
-  ForExprAST(const std::string& varName, std::unique_ptr<ExprAST> start,
-             std::unique_ptr<ExprAST> cond, std::unique_ptr<ExprAST> step,
-             std::unique_ptr<ExprAST> body)
-      : varName(varName),
-        start(std::move(start)),
-        cond(std::move(cond)),
-        step(std::move(step)),
-        body(std::move(body)) {}
-  Value* codegen(GenerateCode* codeGenerator) override {
-    return codeGenerator->codegen(this);
-  }
-  raw_ostream& dump(raw_ostream& out, int ind) override {
-    ExprAST::dump(out << "for", ind);
-    start->dump(indent(out, ind) << "initialization:", ind + 1);
-    cond->dump(indent(out, ind) << "condition:", ind + 1);
-    step->dump(indent(out, ind) << "increment:", ind + 1);
-    body->dump(indent(out, ind) << "body:", ind + 1);
-    return out;
+    return body ? body->dump(out, ind, symbols) : out << "null\n";
   }
 };
@@ -0,0 +1,8 @@
+#pragma once
+
+// Library functions SimpleLang programs can declare extern. The JIT modes
+// hand their addresses to the JIT directly, so they resolve however the
+// compiler itself was linked.
+extern "C" double putchard(double X);
+extern "C" double printd(double X);
+extern "C" double clear();
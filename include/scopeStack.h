@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "llvm/IR/Instructions.h"
+#include "symbolTable.h"
+
+// Variable bindings of the function being lowered. Each symbol maps to its
+// innermost AllocaInst; binding a name records what it shadowed, so leaving
+// a scope only undoes the bindings made inside it.
+class ScopeStack {
+ private:
+  struct Shadowed {
+    Symbol sym;
+    llvm::AllocaInst *previous;
+  };
+
+  std::vector<llvm::AllocaInst *> bindings;
+  std::vector<Shadowed> undoLog;
+  std::vector<size_t> marks;
+
+  void unwindTo(size_t mark) {
+    while (undoLog.size() > mark) {
+      bindings[undoLog.back().sym] = undoLog.back().previous;
+      undoLog.pop_back();
+    }
+  }
+
+ public:
+  llvm::AllocaInst *lookup(Symbol sym) const {
+    return sym < bindings.size() ? bindings[sym] : nullptr;
+  }
+
+  void bind(Symbol sym, llvm::AllocaInst *alloca) {
+    if (sym >= bindings.size()) {
+      bindings.resize(sym + 1, nullptr);
+    }
+    undoLog.push_back({sym, bindings[sym]});
+    bindings[sym] = alloca;
+  }
+
+  void push() { marks.push_back(undoLog.size()); }
+
+  void pop() {
+    unwindTo(marks.back());
+    marks.pop_back();
+  }
+
+  // Drops every scope, including ones left open by a failed codegen.
+  void clear() {
+    unwindTo(0);
+    marks.clear();
+  }
+};
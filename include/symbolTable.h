@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/MathExtras.h"
+
+// Identifiers, function names and operator names are interned once and
+// carried around as 32-bit ids. The spelling of an id stays valid for the
+// lifetime of the table.
+typedef uint32_t Symbol;
+
+// Only one thread may intern. Spellings live in segments that never move
+// once allocated, so other threads may call str() on any id handed to them
+// after it was interned, while interning goes on.
+class SymbolTable {
+ private:
+  // Segment k holds the ids from firstSegmentSize * (2^k - 1) on and is
+  // twice as large as segment k - 1.
+  static constexpr unsigned firstSegmentBits = 6;
+  static constexpr unsigned maxSegments = 32 - firstSegmentBits + 1;
+
+  llvm::StringMap<Symbol, llvm::BumpPtrAllocator> ids;
+  std::unique_ptr<llvm::StringRef[]> segments[maxSegments];
+  Symbol count = 0;
+
+  static unsigned segmentOf(Symbol sym) {
+    return llvm::Log2_32((sym >> firstSegmentBits) + 1);
+  }
+
+  static Symbol segmentStart(unsigned segment) {
+    return ((Symbol)1 << (segment + firstSegmentBits)) -
+           ((Symbol)1 << firstSegmentBits);
+  }
+
+ public:
+  Symbol intern(llvm::StringRef name) {
+    auto inserted = ids.try_emplace(name, count);
+    if (inserted.second) {
+      unsigned segment = segmentOf(count);
+      if (!segments[segment]) {
+        segments[segment].reset(
+            new llvm::StringRef[(size_t)1 << (segment + firstSegmentBits)]);
+      }
+      segments[segment][count - segmentStart(segment)] =
+          inserted.first->getKey();
+      count++;
+    }
+    return inserted.first->getValue();
+  }
+
+  llvm::StringRef str(Symbol sym) const {
+    unsigned segment = segmentOf(sym);
+    return segments[segment][sym - segmentStart(segment)];
+  }
+
+  size_t size() const { return count; }
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "JIT.h"
+#include "optimiser.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+
+// Baseline code calls this with its counter id on every function entry and
+// loop back-edge.
+constexpr const char *tierCountHook = "__sl_tier_count";
+
+// Two-tier execution for -t. A definition first runs as baseline code
+// (no IR passes, no codegen optimisation) behind an indirection stub named
+// after the function. Once its counter reaches the threshold, a background
+// thread rebuilds it from a bitcode snapshot with the optimisation pipeline
+// and repoints the stub. Frames already running baseline code finish there.
+class TierManager {
+ private:
+  struct TieredFunction {
+    std::string name;
+    llvm::SmallVector<char, 0> bitcode;
+  };
+
+  llvm::orc::SimpleJIT &JIT;
+  uint64_t threshold;
+  // Only touched by the worker.
+  Optimiser optimiser;
+
+  // Only touched by the thread running JIT code.
+  std::vector<uint64_t> counts;
+
+  std::mutex lock;
+  std::condition_variable wake;
+  std::vector<TieredFunction> functions;
+  std::deque<unsigned> hot;
+  bool stopping = false;
+  std::thread worker;
+
+  TierManager(llvm::orc::SimpleJIT &JIT, uint64_t threshold,
+              llvm::OptimizationLevel level, const RemarkFilter &remarks);
+
+  void count(unsigned id);
+  void run();
+  llvm::Error recompile(const std::string &name,
+                        llvm::SmallVector<char, 0> bitcode);
+
+  static void countHook(uint32_t id);
+
+ public:
+  ~TierManager();
+
+  static llvm::Expected<std::unique_ptr<TierManager>> create(
+      llvm::orc::SimpleJIT &JIT, uint64_t threshold,
+      llvm::OptimizationLevel level, const RemarkFilter &remarks);
+
+  // Reserves the counter id for a definition that is about to be lowered.
+  unsigned registerFunction(llvm::StringRef name);
+
+  // Takes over the module holding definition F, compiles it as baseline code
+  // and publishes it through a stub under F's name.
+  llvm::Error addDefinition(std::unique_ptr<llvm::Module> M,
+                            std::unique_ptr<llvm::LLVMContext> context,
+                            llvm::Function *F, unsigned id);
+};
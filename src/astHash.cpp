@@ -0,0 +1,143 @@
+#include <cstring>
+
+#include "../include/parser.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/SHA1.h"
+
+namespace {
+class DefinitionHasher {
+ private:
+  SHA1 hasher;
+
+ public:
+  void add(uint64_t value) {
+    uint8_t bytes[sizeof(value)];
+    memcpy(bytes, &value, sizeof(value));
+    hasher.update(bytes);
+  }
+
+  void add(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    add(bits);
+  }
+
+  void add(StringRef str) {
+    add((uint64_t)str.size());
+    hasher.update(str);
+  }
+
+  std::string final() { return toHex(hasher.final(), true); }
+};
+}  // namespace
+
+// Content hash of a definition for incremental builds. It covers the
+// prototype, every node of the body and the arity of each function the body
+// calls, which is everything the code generated for the definition depends
+// on. Source locations are left out since only debug info uses them, and
+// debug builds are never incremental.
+std::string hashDefinition(FunctionAST &fn, StringRef salt,
+                           const SymbolTable &symbols,
+                           const PrototypeMap &functionProtos) {
+  DefinitionHasher H;
+  H.add(salt);
+
+  PrototypeAST &proto = *fn.proto;
+  H.add(proto.getName());
+  H.add((uint64_t)proto.argNames.size());
+  for (Symbol arg : proto.argNames) {
+    H.add(symbols.str(arg));
+  }
+  H.add((uint64_t)proto.isOperator);
+  H.add((uint64_t)proto.precedence);
+  H.add((uint64_t)proto.fastMath);
+
+  SmallVector<ExprAST *, 32> work;
+  work.push_back(fn.body);
+
+  while (!work.empty()) {
+    ExprAST *e = work.pop_back_val();
+    if (!e) {
+      H.add(~(uint64_t)0);
+      continue;
+    }
+
+    H.add((uint64_t)e->getKind());
+    switch (e->getKind()) {
+      case ExprAST::EK_Number:
+        H.add(cast<NumberExprAST>(e)->val);
+        break;
+      case ExprAST::EK_Variable:
+        H.add(symbols.str(cast<VariableExprAST>(e)->name));
+        break;
+      case ExprAST::EK_Var: {
+        auto *a = cast<VarExprAST>(e);
+        H.add((uint64_t)a->vars.size());
+        for (const VarBinding &var : a->vars) {
+          H.add(symbols.str(var.name));
+          work.push_back(var.init);
+        }
+        work.push_back(a->body);
+        break;
+      }
+      case ExprAST::EK_Binary: {
+        auto *a = cast<BinaryExprAST>(e);
+        H.add((uint64_t)(unsigned char)a->op);
+        work.push_back(a->RHS);
+        work.push_back(a->LHS);
+        break;
+      }
+      case ExprAST::EK_Unary: {
+        auto *a = cast<UnaryExprAST>(e);
+        H.add((uint64_t)(unsigned char)a->op);
+        work.push_back(a->operand);
+        break;
+      }
+      case ExprAST::EK_Call: {
+        auto *a = cast<CallExprAST>(e);
+        H.add(symbols.str(a->callee));
+        H.add((uint64_t)a->args.size());
+
+        // The callee's signature is all that leaks into this definition's
+        // code. An unknown callee fails to lower and is never cached.
+        uint64_t arity = ~(uint64_t)0;
+        if (a->callee == proto.name) {
+          arity = proto.argNames.size();
+        } else {
+          auto FI = functionProtos.find(a->callee);
+          if (FI != functionProtos.end()) {
+            arity = FI->second->argNames.size();
+          }
+        }
+        H.add(arity);
+
+        for (ExprAST *arg : llvm::reverse(a->args)) {
+          work.push_back(arg);
+        }
+        break;
+      }
+      case ExprAST::EK_If: {
+        auto *a = cast<IfExprAST>(e);
+        work.push_back(a->_else);
+        work.push_back(a->then);
+        work.push_back(a->cond);
+        break;
+      }
+      case ExprAST::EK_For: {
+        auto *a = cast<ForExprAST>(e);
+        H.add(symbols.str(a->varName));
+        H.add((uint64_t)a->hints.unrollCount);
+        H.add((uint64_t)a->hints.vectorizeWidth);
+        H.add((uint64_t)a->hints.interleaveCount);
+        H.add((uint64_t)a->hints.noVectorize);
+        work.push_back(a->body);
+        work.push_back(a->step);
+        work.push_back(a->cond);
+        work.push_back(a->start);
+        break;
+      }
+    }
+  }
+
+  return H.final();
+}
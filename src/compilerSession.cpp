@@ -0,0 +1,117 @@
+#include "../include/compilerSession.h"
+
+#include <thread>
+
+// Items the front end may run ahead of the back end.
+static constexpr size_t pipelineDepth = 64;
+
+CompilerSession::CompilerSession(CompilerOptions options)
+    : options(std::move(options)), lexer(symbols), codeGenerator(*this) {}
+
+CompilerSession::~CompilerSession() = default;
+
+void CompilerSession::handleDefinition() {
+  if (!genDefinition()) {
+    getNextToken();
+  }
+}
+
+void CompilerSession::handleExtern() {
+  if (!genExtern()) {
+    getNextToken();
+  }
+}
+
+void CompilerSession::handleTopLvlExpr() {
+  if (!genTopLvlExpr()) {
+    getNextToken();
+  }
+}
+
+void CompilerSession::mainLoop() {
+  while (true) {
+    if (parsedItems) undoRejectedOperators();
+    switch (curTok) {
+      case tok_eof:
+        return;
+      case ';':
+        // fprintf(stderr, "Ready>>");
+        getNextToken();
+        break;
+      case tok_def:
+        handleDefinition();
+        break;
+      case tok_extern:
+        handleExtern();
+        break;
+      case tok_number:
+        handleTopLvlExpr();
+        break;
+      case tok_identifier:
+        handleTopLvlExpr();
+        break;
+      default:
+        // fprintf(stderr, "Ready>>");
+        getNextToken();
+        break;
+    }
+  }
+}
+
+// Parses on a second thread while this one lowers what has been parsed so
+// far. Lowering stays on the session's thread, which is where -run executes
+// code.
+void CompilerSession::runPipelined() {
+  BoundedQueue<ParsedItem> queue(pipelineDepth);
+  parsedItems = &queue;
+
+  std::thread frontEnd([this, &queue]() {
+    mainLoop();
+    queue.close();
+  });
+
+  ParsedItem item;
+  while (queue.pop(item)) {
+    lower(std::move(item));
+  }
+
+  frontEnd.join();
+  parsedItems = nullptr;
+}
+
+void CompilerSession::compile() {
+  // fprintf(stderr, "Ready>>");
+  getNextToken();
+
+  if (options.syntaxOnly) {
+    mainLoop();
+    return;
+  }
+
+  initialiseModule();
+  // An unusable object target is reported before any work is done.
+  if (!options.runJIT && !getObjectTargetMachine()) return;
+  if (options.printDebug) codeGenerator.initializeDwarf(options.fileName);
+
+  if (options.pipeline) {
+    runPipelined();
+  } else {
+    mainLoop();
+  }
+
+  if (options.runJIT) {
+    // Waits for a background recompile in flight before the JIT goes.
+    theTiers.reset();
+    return;
+  }
+
+  lowerQueuedDefinitions();
+
+  // Debug info has to be complete before passes start moving code around.
+  codeGenerator.finalizeDwarf();
+  if (!aotCache) optimiseModule(*codeGenerator.theModule);
+
+  printALL();
+
+  compileToObject();
+}
@@ -1,146 +1,271 @@
-#include "../include/parser.h"
-
-extern int getNextToken();
-extern std::unique_ptr<FunctionAST> parseDefinition();
-extern std::unique_ptr<PrototypeAST> parseExtern();
-extern std::unique_ptr<FunctionAST> parseTopLvlExpr();
-
-std::ifstream file;
-std::string outFileName = "out.o";
-std::string fileName;
-
-bool enableDebug = false;
-bool printDebug = false;
-bool printIR = true;
-
-extern void initialiseModule();
-extern bool genDefinition();
-extern bool genExtern();
-extern bool genTopLvlExpr();
-extern void printALL();
-extern void initializeDwarf();
-extern void compileToObject();
-
-static void handleDefinition() {
-  if (!genDefinition()) {
-    getNextToken();
-  }
-}
-
-static void handleExtern() {
-  if (!genExtern()) {
-    getNextToken();
-  }
-}
-
-static void handleTopLvlExpr() {
-  if (!genTopLvlExpr()) {
-    getNextToken();
-  }
-}
-
-static void mainLoop() {
-  while (true) {
-    switch (curTok) {
-      case tok_eof:
-        return;
-      case ';':
-        // fprintf(stderr, "Ready>>");
-        getNextToken();
-        break;
-      case tok_def:
-        handleDefinition();
-        break;
-      case tok_extern:
-        handleExtern();
-        break;
-      case tok_number:
-        handleTopLvlExpr();
-        break;
-      case tok_identifier:
-        handleTopLvlExpr();
-        break;
-      default:
-        // fprintf(stderr, "Ready>>");
-        getNextToken();
-        break;
-    }
-  }
-}
+#include "../include/compilerSession.h"
+#include "../include/fileBuild.h"
+#include "../include/multiversion.h"
 
-#ifdef _WIN32
-#define DLLEXPORT __declspec(dllexport)
-#else
-#define DLLEXPORT
-#endif
+#include <algorithm>
+#include <thread>
 
-/// putchard - putchar that takes a double and returns 0.
-extern "C" DLLEXPORT double putchard(double X) {
-  fputc((char)X, stderr);
-  return 0;
+// Steps past a flag to the argument that follows it, or returns nullptr if
+// the flag came last.
+static const char *takeArgument(int argc, char **argv, int &i) {
+  if (i + 1 >= argc) return nullptr;
+  return argv[++i];
 }
 
-/// printd - printf that takes a double prints it as "%f\n", returning 0.
-extern "C" DLLEXPORT double printd(double X) {
-  fprintf(stderr, "%f\n", X);
-  return 0;
+// Reads a positive count that makes up the whole of the argument.
+template <typename T>
+static bool parseCount(const char *arg, T &value) {
+  return arg && !StringRef(arg).getAsInteger(10, value) && value != 0;
 }
 
-extern "C" DLLEXPORT double clear() {
-  printf("\e[1;1H\e[2J");
-  return 0;
+static void printUsage(const char *program) {
+  std::cout
+      << "Usage: " << program << " [options] <file>...\n"
+      << "  -o <file>           Write the object (or archive) to <file>\n"
+      << "  -run, -lazy, -t <n> Run the program in the JIT: eagerly, lazily,\n"
+      << "                      or tiering up after <n> calls\n"
+      << "  -O0 -O1 -O2 -O3 -Os Optimisation level (default -O2)\n"
+      << "  -Ofast-compile      -O2 on each definition, without the\n"
+      << "                      whole-module pipeline and its inlining\n"
+      << "  -ffast-math         Fast-math flags on floating-point arithmetic\n"
+      << "  -fsyntax-only       Parse and check the file, nothing more\n"
+      << "  -mcpu=<cpu>, -mattr=<features>\n"
+      << "                      Target CPU and features\n"
+      << "  -mversions=<levels> Clone hot functions per x86-64 ISA level\n"
+      << "  -m debug|release    Emit debug info (debug implies -O0)\n"
+      << "  -p ir|noir          Print the IR\n"
+      << "  -pipeline           Overlap parsing with code generation\n"
+      << "  -Rpass=, -Rpass-missed=, -Rpass-analysis=<regex>\n"
+      << "                      Print optimisation remarks\n"
+      << "  -cache <dir>        Reuse objects compiled by earlier runs\n"
+      << "  -cachesize <MB>     Size limit of the -cache directory\n"
+      << "  -j <n>              Lower definitions, or files, on <n> threads\n"
+      << "                      (default: one per file, up to the cores)\n"
+      << "  -split <n>          Emit the module as <n> objects in parallel\n"
+      << "  -                   Read the source from stdin\n"
+      << "  -h, --help          Print this help\n";
 }
 
 int main(int argc, char **argv) {
   if (argc < 2) {
-    std::cout << "Invalid number of arguments" << std::endl;
+    printUsage(argv[0]);
     return 1;
   }
 
+  CompilerOptions options;
+  std::vector<std::string> files;
+  bool optLevelGiven = false;
+  bool jobsGiven = false;
   std::string arg;
 
   for (int i = 1; i < argc; i++) {
     switch (argv[i][0]) {
       case '-':
         switch (argv[i][1]) {
+          case '\0':
+            files.push_back("-");
+            break;
+          case 'h':
+          case '-':
+            arg = argv[i];
+            if (arg != "-h" && arg != "--help") {
+              std::cout << "Invalid argument: " << argv[i] << std::endl;
+              return 1;
+            }
+            printUsage(argv[0]);
+            return 0;
           case 'm':
-            i++;
+            arg = argv[i];
+            if (StringRef(arg).startswith("-mcpu=")) {
+              options.cpu = arg.substr(6);
+              break;
+            }
+            if (StringRef(arg).startswith("-mattr=")) {
+              options.features = arg.substr(7);
+              break;
+            }
+            if (StringRef(arg).startswith("-mversions=")) {
+              if (!parseIsaLevels(arg.substr(11), options.isaLevels)) {
+                std::cout << "Invalid argument for -mversions" << std::endl;
+                return 1;
+              }
+              break;
+            }
+            if (!takeArgument(argc, argv, i)) {
+              std::cout << "Invalid argument for -m" << std::endl;
+              return 1;
+            }
             arg = argv[i];
             if (arg == "debug") {
-              enableDebug = true;
-              printDebug = true;
+              options.enableDebug = true;
+              options.printDebug = true;
             } else if (arg == "release") {
-              enableDebug = false;
-              printDebug = false;
+              options.enableDebug = false;
+              options.printDebug = false;
             } else {
               std::cout << "Invalid argument for -m" << std::endl;
               return 1;
             }
             break;
           case 'p':
-            i++;
+            if (std::string(argv[i]) == "-pipeline") {
+              options.pipeline = true;
+              break;
+            }
+            if (!takeArgument(argc, argv, i)) {
+              std::cout << "Invalid argument for -p" << std::endl;
+              return 1;
+            }
             arg = argv[i];
             if (arg == "ir") {
-              printIR = true;
+              options.printIR = true;
             } else if (arg == "noir") {
-              printIR = false;
+              options.printIR = false;
             } else {
               std::cout << "Invalid argument for -p" << std::endl;
               return 1;
             }
             break;
+          case 'c':
+            arg = argv[i];
+            if (arg == "-cache") {
+              const char *dir = takeArgument(argc, argv, i);
+              if (!dir || !*dir) {
+                std::cout << "Invalid argument for -cache" << std::endl;
+                return 1;
+              }
+              options.cacheDir = dir;
+            } else if (arg == "-cachesize") {
+              if (!parseCount(takeArgument(argc, argv, i),
+                              options.cacheLimitMB)) {
+                std::cout << "Invalid argument for -cachesize" << std::endl;
+                return 1;
+              }
+            } else {
+              std::cout << "Invalid argument: " << argv[i] << std::endl;
+              return 1;
+            }
+            break;
+          case 'j':
+            if (std::string(argv[i]) != "-j") {
+              std::cout << "Invalid argument: " << argv[i] << std::endl;
+              return 1;
+            }
+            if (!parseCount(takeArgument(argc, argv, i), options.jobs)) {
+              std::cout << "Invalid argument for -j" << std::endl;
+              return 1;
+            }
+            jobsGiven = true;
+            break;
+          case 's':
+            if (std::string(argv[i]) != "-split") {
+              std::cout << "Invalid argument: " << argv[i] << std::endl;
+              return 1;
+            }
+            if (!parseCount(takeArgument(argc, argv, i), options.splitParts)) {
+              std::cout << "Invalid argument for -split" << std::endl;
+              return 1;
+            }
+            break;
+          case 'f':
+            arg = argv[i];
+            if (arg == "-ffast-math") {
+              options.fastMath = true;
+            } else if (arg == "-fsyntax-only") {
+              options.syntaxOnly = true;
+            } else {
+              std::cout << "Invalid argument: " << argv[i] << std::endl;
+              return 1;
+            }
+            break;
+          case 'l':
+            if (std::string(argv[i]) != "-lazy") {
+              std::cout << "Invalid argument: " << argv[i] << std::endl;
+              return 1;
+            }
+            options.runJIT = true;
+            options.lazyJIT = true;
+            break;
           case 'n':
-            printDebug = false;
+            options.printDebug = false;
+            break;
+          case 'O':
+            arg = argv[i];
+            if (arg == "-Ofast-compile") {
+              options.optLevel = OptimizationLevel::O2;
+            } else if (arg == "-O0") {
+              options.optLevel = OptimizationLevel::O0;
+            } else if (arg == "-O1") {
+              options.optLevel = OptimizationLevel::O1;
+            } else if (arg == "-O2") {
+              options.optLevel = OptimizationLevel::O2;
+            } else if (arg == "-O3") {
+              options.optLevel = OptimizationLevel::O3;
+            } else if (arg == "-Os") {
+              options.optLevel = OptimizationLevel::Os;
+            } else {
+              std::cout << "Invalid argument: " << argv[i] << std::endl;
+              return 1;
+            }
+            options.wholeModulePipeline = arg != "-Ofast-compile";
+            optLevelGiven = true;
+            break;
+          case 'R': {
+            StringRef flag = argv[i];
+            std::string *pattern = nullptr;
+            if (flag.startswith("-Rpass=")) {
+              pattern = &options.remarks.passed;
+            } else if (flag.startswith("-Rpass-missed=")) {
+              pattern = &options.remarks.missed;
+            } else if (flag.startswith("-Rpass-analysis=")) {
+              pattern = &options.remarks.analysis;
+            } else {
+              std::cout << "Invalid argument: " << argv[i] << std::endl;
+              return 1;
+            }
+            *pattern = flag.split('=').second.str();
+            std::string error;
+            if (!pattern->empty() && !Regex(*pattern).isValid(error)) {
+              std::cout << "Invalid pattern for " << flag.split('=').first.str()
+                        << ": " << error << std::endl;
+              return 1;
+            }
+            break;
+          }
+          case 't':
+            if (std::string(argv[i]) != "-t") {
+              std::cout << "Invalid argument: " << argv[i] << std::endl;
+              return 1;
+            }
+            if (!parseCount(takeArgument(argc, argv, i),
+                            options.tierThreshold)) {
+              std::cout << "Invalid argument for -t" << std::endl;
+              return 1;
+            }
+            options.runJIT = true;
+            break;
+          case 'r':
+            if (std::string(argv[i]) != "-run") {
+              std::cout << "Invalid argument: " << argv[i] << std::endl;
+              return 1;
+            }
+            options.runJIT = true;
             break;
           case 'o':
-            i++;
-            outFileName = argv[i];
-            if (outFileName == "") {
+            if (!takeArgument(argc, argv, i)) {
+              std::cout << "Invalid argument for -o" << std::endl;
+              return 1;
+            }
+            options.outFileName = argv[i];
+            if (options.outFileName == "") {
               std::cout << "Invalid argument for -o" << std::endl;
               return 1;
             }
-            if (outFileName[outFileName.size() - 1] != 'o') {
-              outFileName = outFileName + ".o";
+            // Incremental (-cache) and split (-split) builds write an
+            // archive instead.
+            if (!StringRef(options.outFileName).endswith(".o") &&
+                !StringRef(options.outFileName).endswith(".a")) {
+              options.outFileName = options.outFileName + ".o";
             }
             break;
           default:
@@ -149,36 +274,62 @@ int main(int argc, char **argv) {
         }
         break;
       default:
-        fileName = argv[i];
+        files.push_back(argv[i]);
         break;
     }
   }
 
-  file.open(fileName, std::ios::in);
+  // Debug info is only emitted into object files.
+  if (options.runJIT) options.printDebug = false;
 
-  if (!file.is_open()) {
-    std::cout << "Could not open file \"" << fileName << "\"" << std::endl;
-    return 1;
+  // Debug builds stay unoptimised unless asked otherwise.
+  if (options.enableDebug && !optLevelGiven) {
+    options.optLevel = OptimizationLevel::O0;
   }
 
-  binOpPrecedence[':'] = 1;
-  binOpPrecedence['='] = 2;
-  binOpPrecedence['<'] = 10;
-  binOpPrecedence['+'] = 20;
-  binOpPrecedence['-'] = 20;
-  binOpPrecedence['*'] = 40;
-
-  // fprintf(stderr, "Ready>>");
-  getNextToken();
+  if (options.lazyJIT && options.tierThreshold) {
+    std::cout << "-lazy cannot be combined with -t" << std::endl;
+    return 1;
+  }
 
-  initialiseModule();
-  if(printDebug) initializeDwarf();
+  if (options.splitParts > 1 && !options.cacheDir.empty() &&
+      !options.runJIT) {
+    std::cout << "-split cannot be combined with -cache" << std::endl;
+    return 1;
+  }
+  // Splitting the module would drop the ifuncs.
+  if (options.splitParts > 1 && !options.isaLevels.empty()) {
+    std::cout << "-split cannot be combined with -mversions" << std::endl;
+    return 1;
+  }
 
-  mainLoop();
+  if (files.size() > 1) {
+    if (options.runJIT) {
+      std::cout << "-run, -lazy and -t take a single file" << std::endl;
+      return 1;
+    }
+    if (options.syntaxOnly) {
+      std::cout << "-fsyntax-only takes a single file" << std::endl;
+      return 1;
+    }
+    // The files are compiled by sessions of their own, so unless -j says
+    // otherwise they are all lowered at once, up to one per core.
+    if (!jobsGiven) {
+      options.jobs = std::min<unsigned>(
+          files.size(), std::max(1u, std::thread::hardware_concurrency()));
+    }
+    return buildFiles(options, files) ? 0 : 1;
+  }
+  if (!files.empty()) options.fileName = files[0];
 
-  printALL();
+  CompilerSession session(options);
+  if (!session.openSource(options.fileName)) {
+    std::cout << "Could not open file \"" << options.fileName << "\""
+              << std::endl;
+    return 1;
+  }
 
-  compileToObject();
+  session.compile();
 
   // initialize();
 
@@ -0,0 +1,188 @@
+#include "../include/fileBuild.h"
+
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <thread>
+
+#include "llvm/Object/Archive.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Support/Path.h"
+
+namespace {
+
+struct FileResult {
+  std::string output;
+  FileInterface interface;
+};
+
+// Every function a build defines, with the file it comes from.
+struct Definition {
+  size_t file;
+  unsigned arity;
+};
+
+}  // namespace
+
+static std::string objectNameFor(const CompilerOptions &options,
+                                 const std::string &file) {
+  SmallString<128> path = sys::path::parent_path(options.outFileName);
+  sys::path::append(path, sys::path::stem(file) + ".o");
+  return path.str().str();
+}
+
+static void compileFile(const CompilerOptions &options,
+                        const std::string &file, FileResult &result) {
+  CompilerOptions fileOptions = options;
+  fileOptions.fileName = file;
+  fileOptions.outFileName = objectNameFor(options, file);
+  // Files are the unit of parallelism here, and IR dumps of files compiled
+  // side by side would interleave.
+  fileOptions.jobs = 1;
+  fileOptions.printIR = false;
+
+  CompilerSession session(fileOptions);
+  if (!session.openSource(file)) {
+    fprintf(stderr, "LogError: Could not open file \"%s\"\n", file.c_str());
+    return;
+  }
+  session.compile();
+
+  result.output = session.getWrittenFile();
+  result.interface = session.getInterface();
+}
+
+// Reports functions defined by more than one file, and externs that name a
+// function of another file with a different number of arguments. Externs
+// no file defines are left to the runtime.
+static bool checkInterfaces(const std::vector<std::string> &files,
+                            const std::vector<FileResult> &results) {
+  bool ok = true;
+  std::map<std::string, Definition> definitions;
+  for (size_t i = 0; i < files.size(); i++) {
+    for (auto &fn : results[i].interface.defined) {
+      auto inserted = definitions.insert({fn.first, {i, fn.second}});
+      if (!inserted.second) {
+        fprintf(stderr, "LogError: %s is defined in both %s and %s\n",
+                fn.first.c_str(), files[inserted.first->second.file].c_str(),
+                files[i].c_str());
+        ok = false;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < files.size(); i++) {
+    for (auto &ext : results[i].interface.externs) {
+      auto def = definitions.find(ext.first);
+      if (def != definitions.end() && def->second.arity != ext.second) {
+        fprintf(stderr,
+                "LogError: %s declares extern %s with %u arguments, but %s "
+                "defines it with %u\n",
+                files[i].c_str(), ext.first.c_str(), ext.second,
+                files[def->second.file].c_str(), def->second.arity);
+        ok = false;
+      }
+    }
+  }
+  return ok;
+}
+
+// Adds an object, or the members of an archive built by -cache or -split.
+static bool addMembers(const std::string &output,
+                       std::vector<std::unique_ptr<MemoryBuffer>> &buffers,
+                       std::vector<NewArchiveMember> &members) {
+  auto buffer = MemoryBuffer::getFile(output);
+  if (!buffer) {
+    fprintf(stderr, "LogError: Could not read %s\n", output.c_str());
+    return false;
+  }
+  buffers.push_back(std::move(*buffer));
+  MemoryBufferRef ref = buffers.back()->getMemBufferRef();
+
+  if (!StringRef(output).endswith(".a")) {
+    members.emplace_back(ref);
+    members.back().MemberName = sys::path::filename(output);
+    return true;
+  }
+
+  Error err = Error::success();
+  object::Archive archive(ref, err);
+  if (err) {
+    logAllUnhandledErrors(std::move(err), errs(), "LogError: ");
+    return false;
+  }
+  for (auto &child : archive.children(err)) {
+    auto member = NewArchiveMember::getOldMember(child, true);
+    if (!member) {
+      logAllUnhandledErrors(member.takeError(), errs(), "LogError: ");
+      return false;
+    }
+    members.push_back(std::move(*member));
+  }
+  if (err) {
+    logAllUnhandledErrors(std::move(err), errs(), "LogError: ");
+    return false;
+  }
+  return true;
+}
+
+bool buildFiles(const CompilerOptions &options,
+                const std::vector<std::string> &files) {
+  std::map<std::string, size_t> objectNames;
+  for (size_t i = 0; i < files.size(); i++) {
+    auto inserted = objectNames.insert({objectNameFor(options, files[i]), i});
+    if (!inserted.second) {
+      fprintf(stderr, "LogError: %s and %s would both be compiled to %s\n",
+              files[inserted.first->second].c_str(), files[i].c_str(),
+              inserted.first->first.c_str());
+      return false;
+    }
+  }
+
+  std::vector<FileResult> results(files.size());
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+  size_t threads = std::min<size_t>(options.jobs, files.size());
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([&]() {
+      for (size_t i = next++; i < files.size(); i = next++) {
+        compileFile(options, files[i], results[i]);
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  bool ok = true;
+  for (size_t i = 0; i < files.size(); i++) {
+    if (results[i].output.empty()) {
+      fprintf(stderr, "LogError: %s was not built\n", files[i].c_str());
+      ok = false;
+    }
+  }
+  if (!ok || !checkInterfaces(files, results)) {
+    return false;
+  }
+
+  std::vector<std::unique_ptr<MemoryBuffer>> buffers;
+  std::vector<NewArchiveMember> members;
+  for (auto &result : results) {
+    if (!addMembers(result.output, buffers, members)) {
+      return false;
+    }
+  }
+
+  std::string archiveName = options.outFileName;
+  if (StringRef(archiveName).endswith(".o")) {
+    archiveName.back() = 'a';
+  }
+  if (auto err = writeArchive(archiveName, members, true,
+                              object::Archive::K_GNU, true, false)) {
+    logAllUnhandledErrors(std::move(err), errs(), "LogError: ");
+    return false;
+  }
+
+  outs() << "Wrote " << archiveName << "\n";
+  return true;
+}
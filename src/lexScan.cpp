@@ -0,0 +1,157 @@
+#include "../include/lexScan.h"
+
+// -DLEXSCAN_SCALAR builds only the scalar scanners, for comparison.
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(LEXSCAN_SCALAR)
+#define LEXSCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+enum class ScanClass { whitespace, identifier, number, lineEnd };
+
+template <ScanClass C>
+inline bool inClass(unsigned char c) {
+  if constexpr (C == ScanClass::whitespace) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+  } else if constexpr (C == ScanClass::identifier) {
+    return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+  } else if constexpr (C == ScanClass::number) {
+    return (c >= '0' && c <= '9') || c == '.';
+  } else {
+    return c != '\n' && c != '\r';
+  }
+}
+
+template <ScanClass C>
+const char *scanScalar(const char *ptr, const char *end) {
+  while (ptr != end && inClass<C>(*ptr)) {
+    ptr++;
+  }
+  return ptr;
+}
+
+#ifdef LEXSCAN_X86
+// Bytes >= 0x80 compare as negative, so the signed range checks below
+// never accept them, matching the "C" locale classification.
+template <ScanClass C>
+__attribute__((target("sse2"))) inline __m128i classify128(__m128i v) {
+  if constexpr (C == ScanClass::whitespace) {
+    __m128i ctrl = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1)),
+                                 _mm_cmplt_epi8(v, _mm_set1_epi8('\r' + 1)));
+    return _mm_or_si128(ctrl, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+  } else if constexpr (C == ScanClass::identifier) {
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i alpha =
+        _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                      _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+    return _mm_or_si128(digit, alpha);
+  } else if constexpr (C == ScanClass::number) {
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    return _mm_or_si128(digit, _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+  } else {
+    __m128i eol = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                               _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    return _mm_xor_si128(eol, _mm_set1_epi8(-1));
+  }
+}
+
+template <ScanClass C>
+__attribute__((target("sse2"))) const char *scanSSE2(const char *ptr,
+                                                     const char *end) {
+  while (end - ptr >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)ptr);
+    unsigned stop = ~(unsigned)_mm_movemask_epi8(classify128<C>(v)) & 0xFFFF;
+    if (stop) {
+      return ptr + __builtin_ctz(stop);
+    }
+    ptr += 16;
+  }
+  return scanScalar<C>(ptr, end);
+}
+
+template <ScanClass C>
+__attribute__((target("avx2"))) inline __m256i classify256(__m256i v) {
+  if constexpr (C == ScanClass::whitespace) {
+    __m256i ctrl =
+        _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('\t' - 1)),
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), v));
+    return _mm256_or_si256(ctrl, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+  } else if constexpr (C == ScanClass::identifier) {
+    __m256i digit =
+        _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i alpha =
+        _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+    return _mm256_or_si256(digit, alpha);
+  } else if constexpr (C == ScanClass::number) {
+    __m256i digit =
+        _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    return _mm256_or_si256(digit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.')));
+  } else {
+    __m256i eol = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                                  _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+    return _mm256_xor_si256(eol, _mm256_set1_epi8(-1));
+  }
+}
+
+template <ScanClass C>
+__attribute__((target("avx2"))) const char *scanAVX2(const char *ptr,
+                                                     const char *end) {
+  while (end - ptr >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)ptr);
+    unsigned stop = ~(unsigned)_mm256_movemask_epi8(classify256<C>(v));
+    if (stop) {
+      return ptr + __builtin_ctz(stop);
+    }
+    ptr += 32;
+  }
+  return scanSSE2<C>(ptr, end);
+}
+#endif
+
+typedef const char *(*ScanFn)(const char *, const char *);
+
+struct ScanTable {
+  ScanFn whitespace, identifier, number, lineEnd;
+};
+
+ScanTable selectScanTable() {
+#ifdef LEXSCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return {scanAVX2<ScanClass::whitespace>, scanAVX2<ScanClass::identifier>,
+            scanAVX2<ScanClass::number>, scanAVX2<ScanClass::lineEnd>};
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return {scanSSE2<ScanClass::whitespace>, scanSSE2<ScanClass::identifier>,
+            scanSSE2<ScanClass::number>, scanSSE2<ScanClass::lineEnd>};
+  }
+#endif
+  return {scanScalar<ScanClass::whitespace>, scanScalar<ScanClass::identifier>,
+          scanScalar<ScanClass::number>, scanScalar<ScanClass::lineEnd>};
+}
+
+const ScanTable scanTable = selectScanTable();
+}  // namespace
+
+const char *scanWhitespace(const char *ptr, const char *end) {
+  return scanTable.whitespace(ptr, end);
+}
+
+const char *scanIdentifier(const char *ptr, const char *end) {
+  return scanTable.identifier(ptr, end);
+}
+
+const char *scanNumber(const char *ptr, const char *end) {
+  return scanTable.number(ptr, end);
+}
+
+const char *scanLineEnd(const char *ptr, const char *end) {
+  return scanTable.lineEnd(ptr, end);
+}
@@ -1,95 +1,167 @@
-#include <cstdlib>
+#include <charconv>
+#include <cstdio>
 #include <iostream>
+#include <iterator>
+#include <memory>
 #include <string>
-#include <fstream>
+#include <string_view>
 
+#include "../include/keywordTable.h"
 #include "../include/lexExtern.h"
+#include "../include/lexScan.h"
 
-std::string identifierStr;
-double numVal;
+bool Lexer::openSource(const std::string &name) {
+  auto buffer = llvm::MemoryBuffer::getFileOrSTDIN(
+      name, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    return false;
+  }
+
+  sourceBuffer = std::move(*buffer);
+  curPtr = sourceBuffer->getBufferStart();
+  bufEnd = sourceBuffer->getBufferEnd();
+  return true;
+}
+
+namespace {
+struct Keyword {
+  std::string_view spelling;
+  Token tok;
+};
+
+// Every reserved word of the language; adding a keyword is a one-line change.
+constexpr Keyword keywords[] = {
+    {"def", tok_def},       {"DEF", tok_def}, {"define", tok_def},
+    {"extern", tok_extern}, {"EXTERN", tok_extern},
+    {"if", tok_if},         {"IF", tok_if},
+    {"then", tok_then},     {"THEN", tok_then},
+    {"else", tok_else},     {"ELSE", tok_else},
+    {"for", tok_for},       {"FOR", tok_for},
+    {"when", tok_when},     {"WHEN", tok_when},
+    {"inc", tok_inc},       {"INC", tok_inc},
+    {"do", tok_do},         {"DO", tok_do},
+    {"binary", tok_binary}, {"unary", tok_unary},
+    {"var", tok_var},       {"VAR", tok_var},
+    {"in", tok_in},         {"IN", tok_in},
+};
+
+constexpr size_t maxKeywordLength() {
+  size_t len = 0;
+  for (const auto &kw : keywords) {
+    len = kw.spelling.size() > len ? kw.spelling.size() : len;
+  }
+  return len;
+}
+
+constexpr std::string_view keywordSpelling(size_t i) {
+  return keywords[i].spelling;
+}
+
+constexpr auto keywordTable =
+    buildKeywordTable<6>(std::size(keywords), keywordSpelling);
+static_assert(keywordTable.seed != 0,
+              "no perfect hash for the keyword list, grow the table bits");
+
+int lookupKeyword(const char *str, size_t len) {
+  if (len > maxKeywordLength()) {
+    return tok_identifier;
+  }
+
+  int idx = keywordTable.find(str, len, keywordSpelling);
+  return idx >= 0 ? keywords[idx].tok : tok_identifier;
+}
+}  // namespace
+
+void Lexer::skipWhitespace() {
+  if (curPtr == bufEnd || !isspace(*curPtr)) {
+    return;
+  }
 
-SourceLocation curLoc;
-SourceLocation lexLoc = {1, 0};
+  const char *runEnd = scanWhitespace(curPtr + 1, bufEnd);
+  const char *lineStart = nullptr;
 
-extern int advance() {
-  int lastChar = file.get();
+  for (const char *p = curPtr; p != runEnd; p++) {
+    if (*p == '\n' || *p == '\r') {
+      lexLoc.line++;
+      lineStart = p + 1;
+    }
+  }
 
-  if (lastChar == '\n' || lastChar == '\r') {
-    lexLoc.line++;
-    lexLoc.col = 0;
+  if (lineStart) {
+    lexLoc.col = runEnd - lineStart;
   } else {
-    lexLoc.col++;
+    lexLoc.col += runEnd - curPtr;
   }
-  return lastChar;
+  curPtr = runEnd;
 }
 
-extern int getToken() {
-  static char lastChar = ' ';
+int Lexer::getToken() {
+  skipWhitespace();
 
-  while (isspace(lastChar)) {
-    lastChar = advance();
+  while (curPtr != bufEnd && *curPtr == '#') {
+    const char *commentEnd = scanLineEnd(curPtr, bufEnd);
+    lexLoc.col += commentEnd - curPtr;
+    curPtr = commentEnd;
+    skipWhitespace();
   }
 
+  curLoc = lexLoc;
+
+  if (curPtr == bufEnd) {
+    return tok_eof;
+  }
+
+  const char *tokStart = curPtr;
+  char lastChar = *curPtr;
+
   if (isalpha(lastChar)) {
-    identifierStr.erase();
-    identifierStr.push_back(lastChar);
+    curPtr = scanIdentifier(curPtr + 1, bufEnd);
 
-    while (isalnum(lastChar = advance())) {
-      identifierStr.push_back(lastChar);
-    }
+    size_t len = curPtr - tokStart;
+    lexLoc.col += len;
 
-    if (identifierStr == "def" || identifierStr == "DEF" ||
-        identifierStr == "define") {
-      return tok_def;
-    } else if (identifierStr == "extern" || identifierStr == "EXTERN") {
-      return tok_extern;
-    } else if (identifierStr == "if" || identifierStr == "IF") {
-      return tok_if;
-    } else if (identifierStr == "then" || identifierStr == "THEN") {
-      return tok_then;
-    } else if (identifierStr == "else" || identifierStr == "ELSE") {
-      return tok_else;
-    } else if (identifierStr == "for" || identifierStr == "FOR") {
-      return tok_for;
-    } else if (identifierStr == "when" || identifierStr == "WHEN") {
-      return tok_when;
-    } else if (identifierStr == "inc" || identifierStr == "INC") {
-      return tok_inc;
-    } else if (identifierStr == "do" || identifierStr == "DO") {
-      return tok_do;
-    } else if (identifierStr == "binary") {
-      return tok_binary;
-    } else if (identifierStr == "unary") {
-      return tok_unary;
-    } else if (identifierStr == "var" || identifierStr == "VAR") {
-      return tok_var;
-    } else if (identifierStr == "in" || identifierStr == "IN") {
-      return tok_in;
-    } else {
-      return tok_identifier;
+    int tok = lookupKeyword(tokStart, len);
+    if (tok == tok_identifier) {
+      identifierSym = symbols.intern(llvm::StringRef(tokStart, len));
     }
+    return tok;
   } else if (isdigit(lastChar) || lastChar == '.') {
-    std::string numStr;
-    do {
-      numStr.push_back(lastChar);
-      lastChar = advance();
-    } while (isdigit(lastChar) || lastChar == '.');
+    curPtr = scanNumber(curPtr + 1, bufEnd);
+    lexLoc.col += curPtr - tokStart;
 
-    numVal = strtod(numStr.c_str(), 0);
-    return tok_number;
-  } else if (lastChar == '#') {
-    do {
-      lastChar = getToken();
-    } while (lastChar != EOF && lastChar != '\n' && lastChar != '\r');
-
-    if (lastChar != EOF) {
-      return getToken();
-    } else {
-      return tok_eof;
+    // The literal is converted in place; anything from_chars does not
+    // consume entirely (a second '.', a lone '.') is rejected, and the
+    // parser drops the definition it appears in.
+    auto result = std::from_chars(tokStart, curPtr, numVal);
+    numValid = result.ec == std::errc() && result.ptr == curPtr;
+    if (!numValid) {
+      fprintf(stderr, "LogError: %d:%d: Malformed number literal '%.*s'\n",
+              curLoc.line, curLoc.col, (int)(curPtr - tokStart), tokStart);
+      numVal = 0;
     }
+    return tok_number;
+  }
+
+  curPtr++;
+  lexLoc.col++;
+
+  char nextChar = curPtr != bufEnd ? *curPtr : '\0';
+  int pairTok = 0;
+  if (nextChar == '=') {
+    pairTok = lastChar == '<'   ? tok_le
+              : lastChar == '>' ? tok_ge
+              : lastChar == '=' ? tok_eq
+              : lastChar == '!' ? tok_ne
+                                : 0;
+  } else if (nextChar == lastChar) {
+    pairTok = lastChar == '&' ? tok_and : lastChar == '|' ? tok_or : 0;
+  }
+  if (pairTok) {
+    curPtr++;
+    lexLoc.col++;
+    return pairTok;
   }
 
-  int thisChar = lastChar;
-  lastChar = advance();
-  return thisChar;
+  // Bytes above 0x7f must not come out negative, where the tokens are.
+  return (unsigned char)lastChar;
 }
@@ -0,0 +1,222 @@
+#include "../include/multiversion.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/GlobalIFunc.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/Support/X86TargetParser.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+using namespace llvm;
+
+static const char *isaLevelFn = "__sl_isa_level";
+
+static std::string getLevelName(unsigned level) {
+  return level == 1 ? "x86-64" : "x86-64-v" + std::to_string(level);
+}
+
+// Compiles F for exactly one ISA level. The feature string replaces the
+// target machine's, so -mcpu and -mattr cannot add instructions the level
+// does not have.
+static void setIsaLevel(Function &F, unsigned level) {
+  SmallVector<StringRef, 32> features;
+  X86::getFeaturesForCPU(getLevelName(level), features);
+
+  std::string featureString;
+  for (StringRef feature : features) {
+    if (!featureString.empty()) featureString += ",";
+    featureString += "+" + feature.str();
+  }
+
+  F.addFnAttr("target-cpu", getLevelName(level));
+  F.addFnAttr("target-features", featureString);
+}
+
+bool parseIsaLevels(StringRef list, std::vector<unsigned> &levels) {
+  SmallVector<StringRef, 4> names;
+  list.split(names, ',', -1, false);
+  for (StringRef name : names) {
+    unsigned level = 1;
+    while (level <= 4 && getLevelName(level) != name) {
+      level++;
+    }
+    if (level > 4) {
+      fprintf(stderr, "LogError: Unknown ISA level %s\n", name.str().c_str());
+      return false;
+    }
+    levels.push_back(level);
+  }
+  return !levels.empty();
+}
+
+// Defines a function returning the highest x86-64 ISA level the running CPU
+// and OS support, by the feature lists of the x86-64 psABI.
+static Function *getIsaLevelFunction(Module &M) {
+  if (Function *F = M.getFunction(isaLevelFn)) {
+    return F;
+  }
+
+  LLVMContext &C = M.getContext();
+  Type *i32 = Type::getInt32Ty(C);
+  Function *F = Function::Create(FunctionType::get(i32, false),
+                                 GlobalValue::InternalLinkage, isaLevelFn, M);
+  F->addFnAttr(Attribute::NoUnwind);
+
+  BasicBlock *entry = BasicBlock::Create(C, "entry", F);
+  BasicBlock *readXCR0 = BasicBlock::Create(C, "xgetbv", F);
+  BasicBlock *done = BasicBlock::Create(C, "done", F);
+  IRBuilder<> B(entry);
+
+  StructType *cpuidRegs = StructType::get(i32, i32, i32, i32);
+  InlineAsm *cpuidAsm = InlineAsm::get(
+      FunctionType::get(cpuidRegs, {i32, i32}, false), "cpuid",
+      "={ax},={bx},={cx},={dx},{ax},{cx},~{dirflag},~{fpsr},~{flags}", false);
+  // Leaves above the highest one supported read as zero.
+  auto cpuid = [&](uint32_t leaf, Value *supported) {
+    Value *regs = B.CreateCall(cpuidAsm, {B.getInt32(leaf), B.getInt32(0)});
+    regs = B.CreateSelect(supported, regs, Constant::getNullValue(cpuidRegs));
+    return regs;
+  };
+  auto hasAll = [&](Value *regs, unsigned reg, uint32_t mask) {
+    Value *bits = B.CreateAnd(B.CreateExtractValue(regs, reg), mask);
+    return B.CreateICmpEQ(bits, B.getInt32(mask));
+  };
+  enum { EAX, EBX, ECX, EDX };
+
+  Value *basic = cpuid(0, B.getTrue());
+  Value *maxLeaf = B.CreateExtractValue(basic, EAX);
+  Value *extended = cpuid(0x80000000, B.getTrue());
+  Value *maxExtLeaf = B.CreateExtractValue(extended, EAX);
+  Value *leaf1 = cpuid(1, B.CreateICmpUGE(maxLeaf, B.getInt32(1)));
+  Value *leaf7 = cpuid(7, B.CreateICmpUGE(maxLeaf, B.getInt32(7)));
+  Value *ext1 =
+      cpuid(0x80000001, B.CreateICmpUGE(maxExtLeaf, B.getInt32(0x80000001)));
+
+  // xgetbv faults unless the OS has enabled XSAVE.
+  Value *osxsave = hasAll(leaf1, ECX, 1u << 27);
+  B.CreateCondBr(osxsave, readXCR0, done);
+
+  B.SetInsertPoint(readXCR0);
+  InlineAsm *xgetbvAsm = InlineAsm::get(
+      FunctionType::get(StructType::get(i32, i32), {i32}, false),
+      ".byte 0x0f, 0x01, 0xd0", "={ax},={dx},{cx},~{dirflag},~{fpsr},~{flags}",
+      true);
+  Value *xcr0Read =
+      B.CreateExtractValue(B.CreateCall(xgetbvAsm, {B.getInt32(0)}), 0);
+  B.CreateBr(done);
+
+  B.SetInsertPoint(done);
+  PHINode *xcr0 = B.CreatePHI(i32, 2);
+  xcr0->addIncoming(B.getInt32(0), entry);
+  xcr0->addIncoming(xcr0Read, readXCR0);
+
+  // v2: SSE3, SSSE3, CMPXCHG16B, SSE4.1, SSE4.2, POPCNT and LAHF/SAHF.
+  Value *v2 = B.CreateAnd(
+      hasAll(leaf1, ECX, (1u << 0) | (1u << 9) | (1u << 13) | (1u << 19) |
+                             (1u << 20) | (1u << 23)),
+      hasAll(ext1, ECX, 1u << 0));
+  // v3: FMA, MOVBE, AVX, F16C, BMI1, AVX2, BMI2 and LZCNT, with the OS
+  // saving the SSE and AVX state.
+  Value *v3 = B.CreateAnd(
+      {v2,
+       hasAll(leaf1, ECX, (1u << 12) | (1u << 22) | (1u << 28) | (1u << 29)),
+       hasAll(leaf7, EBX, (1u << 3) | (1u << 5) | (1u << 8)),
+       hasAll(ext1, ECX, 1u << 5),
+       B.CreateICmpEQ(B.CreateAnd(xcr0, 0x6), B.getInt32(0x6))});
+  // v4: AVX512F, DQ, CD, BW and VL, with the OS saving the AVX-512 state.
+  Value *v4 = B.CreateAnd(
+      {v3,
+       hasAll(leaf7, EBX,
+              (1u << 16) | (1u << 17) | (1u << 28) | (1u << 30) | (1u << 31)),
+       B.CreateICmpEQ(B.CreateAnd(xcr0, 0xe6), B.getInt32(0xe6))});
+
+  Value *level = B.getInt32(1);
+  for (Value *atLeast : {v2, v3, v4}) {
+    level = B.CreateAdd(level, B.CreateZExt(atLeast, i32));
+  }
+  B.CreateRet(level);
+  return F;
+}
+
+static bool containsLoop(Function &F) {
+  DominatorTree DT(F);
+  LoopInfo LI(DT);
+  return !LI.empty();
+}
+
+unsigned multiversionFunctions(Module &M, ArrayRef<unsigned> levels) {
+  std::vector<unsigned> descending(levels.begin(), levels.end());
+  std::sort(descending.rbegin(), descending.rend());
+  descending.erase(std::unique(descending.begin(), descending.end()),
+                   descending.end());
+
+  std::vector<Function *> versioned;
+  for (Function &F : M) {
+    if (!F.isDeclaration() && F.hasExternalLinkage() &&
+        F.getName() != "main" && containsLoop(F)) {
+      versioned.push_back(&F);
+    }
+  }
+
+  for (Function *F : versioned) {
+    std::string name = F->getName().str();
+
+    std::vector<std::pair<unsigned, Function *>> clones;
+    // Recursive calls are mapped to the clone itself, and the fallback
+    // keeps its own below, so only the outermost call goes through the
+    // ifunc.
+    for (unsigned level : descending) {
+      Function *clone = Function::Create(
+          F->getFunctionType(), GlobalValue::InternalLinkage,
+          F->getAddressSpace(), name + "." + getLevelName(level), &M);
+      ValueToValueMapTy VMap;
+      VMap[F] = clone;
+      Argument *cloneArg = clone->arg_begin();
+      for (Argument &arg : F->args()) {
+        cloneArg->setName(arg.getName());
+        VMap[&arg] = cloneArg++;
+      }
+      SmallVector<ReturnInst *, 4> returns;
+      CloneFunctionInto(clone, F, VMap,
+                        CloneFunctionChangeType::LocalChangesOnly, returns);
+      setIsaLevel(*clone, level);
+      clones.push_back({level, clone});
+    }
+    // The fallback runs on CPUs below every requested level.
+    F->setName(name + ".default");
+    F->setLinkage(GlobalValue::InternalLinkage);
+    setIsaLevel(*F, 1);
+
+    Function *resolver = Function::Create(
+        FunctionType::get(F->getType(), false), GlobalValue::InternalLinkage,
+        name + ".resolver", M);
+    GlobalIFunc *ifunc =
+        GlobalIFunc::create(F->getFunctionType(), F->getAddressSpace(),
+                            GlobalValue::ExternalLinkage, name, resolver, &M);
+    F->replaceUsesWithIf(ifunc, [F](Use &U) {
+      auto *I = dyn_cast<Instruction>(U.getUser());
+      return !I || I->getFunction() != F;
+    });
+
+    IRBuilder<> B(BasicBlock::Create(M.getContext(), "entry", resolver));
+    Value *level = B.CreateCall(getIsaLevelFunction(M));
+    for (auto &clone : clones) {
+      BasicBlock *pick =
+          BasicBlock::Create(M.getContext(), "pick", resolver);
+      BasicBlock *next = BasicBlock::Create(M.getContext(), "next", resolver);
+      B.CreateCondBr(B.CreateICmpUGE(level, B.getInt32(clone.first)), pick,
+                     next);
+      B.SetInsertPoint(pick);
+      B.CreateRet(clone.second);
+      B.SetInsertPoint(next);
+    }
+    B.CreateRet(F);
+  }
+  return versioned.size();
+}
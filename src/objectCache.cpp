@@ -0,0 +1,174 @@
+#include "../include/objectCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+static const char objectSuffix[] = ".o";
+
+DiskObjectCache::DiskObjectCache(std::string dir, std::string salt,
+                                 uint64_t maxBytes)
+    : dir(std::move(dir)), salt(std::move(salt)), maxBytes(maxBytes) {
+  if (auto EC = sys::fs::create_directories(this->dir)) {
+    fprintf(stderr, "LogError: Could not create cache directory %s: %s\n",
+            this->dir.c_str(), EC.message().c_str());
+    return;
+  }
+
+  std::error_code EC;
+  for (sys::fs::directory_iterator it(this->dir, EC), end; it != end && !EC;
+       it.increment(EC)) {
+    if (auto status = it->status()) {
+      totalBytes += status->getSize();
+    }
+  }
+}
+
+// The module's identifier and source file name go into its bitcode, but not
+// into the code, so they are left out of the key: the same definitions read
+// from another path still hit. The module belongs to the thread compiling
+// it, so they can be cleared for the moment the bitcode is written.
+std::string DiskObjectCache::getKey(const Module *M) {
+  Module &named = const_cast<Module &>(*M);
+  std::string moduleId = named.getModuleIdentifier();
+  std::string sourceFileName = named.getSourceFileName();
+  named.setModuleIdentifier("");
+  named.setSourceFileName("");
+
+  SmallVector<char, 0> bitcode;
+  raw_svector_ostream OS(bitcode);
+  WriteBitcodeToFile(*M, OS);
+
+  named.setModuleIdentifier(moduleId);
+  named.setSourceFileName(sourceFileName);
+
+  SHA1 hasher;
+  hasher.update(salt);
+  hasher.update(
+      arrayRefFromStringRef(StringRef(bitcode.data(), bitcode.size())));
+
+  return toHex(hasher.final(), true);
+}
+
+std::string DiskObjectCache::getPath(StringRef key) {
+  SmallString<128> path(dir);
+  sys::path::append(path, key + objectSuffix);
+  return std::string(path.str());
+}
+
+std::unique_ptr<MemoryBuffer> DiskObjectCache::getObject(const Module *M) {
+  return lookup(getKey(M));
+}
+
+void DiskObjectCache::notifyObjectCompiled(const Module *M,
+                                           MemoryBufferRef obj) {
+  store(getKey(M), obj);
+}
+
+std::unique_ptr<MemoryBuffer> DiskObjectCache::lookup(StringRef key) {
+  std::string path = getPath(key);
+
+  int FD;
+  if (sys::fs::openFileForRead(path, FD)) {
+    return nullptr;
+  }
+
+  // Reading an entry counts as a use for eviction.
+  sys::fs::setLastAccessAndModificationTime(FD,
+                                           std::chrono::system_clock::now());
+
+  auto buffer = MemoryBuffer::getOpenFile(sys::fs::convertFDToNativeFile(FD),
+                                          path, -1);
+  sys::Process::SafelyCloseFileDescriptor(FD);
+  if (!buffer) {
+    return nullptr;
+  }
+
+  return std::move(*buffer);
+}
+
+void DiskObjectCache::store(StringRef key, MemoryBufferRef obj) {
+  std::string path = getPath(key);
+
+  // Write to a unique name and rename, so a concurrent reader never sees a
+  // partially written object.
+  int FD;
+  SmallString<128> tmpPath;
+  if (sys::fs::createUniqueFile(path + ".tmp%%%%%%", FD, tmpPath)) {
+    return;
+  }
+
+  {
+    raw_fd_ostream OS(FD, true);
+    OS << obj.getBuffer();
+    if (OS.has_error()) {
+      OS.clear_error();
+      sys::fs::remove(tmpPath);
+      return;
+    }
+  }
+
+  if (sys::fs::rename(tmpPath, path)) {
+    sys::fs::remove(tmpPath);
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  totalBytes += obj.getBufferSize();
+  if (totalBytes > maxBytes) {
+    evict();
+  }
+}
+
+// Removes the least recently used objects until the directory is back
+// under three quarters of the limit, so eviction does not run on every store.
+void DiskObjectCache::evict() {
+  struct Entry {
+    std::string path;
+    sys::TimePoint<> lastUsed;
+    uint64_t size;
+  };
+
+  std::vector<Entry> entries;
+  totalBytes = 0;
+
+  std::error_code EC;
+  for (sys::fs::directory_iterator it(dir, EC), end; it != end && !EC;
+       it.increment(EC)) {
+    if (sys::path::extension(it->path()) != objectSuffix) {
+      continue;
+    }
+    if (auto status = it->status()) {
+      entries.push_back(
+          {it->path(), status->getLastModificationTime(), status->getSize()});
+      totalBytes += status->getSize();
+    }
+  }
+
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) {
+              return a.lastUsed < b.lastUsed;
+            });
+
+  uint64_t target = maxBytes / 4 * 3;
+  for (const Entry &entry : entries) {
+    if (totalBytes <= target) {
+      break;
+    }
+    if (!sys::fs::remove(entry.path)) {
+      totalBytes -= entry.size;
+    }
+  }
+}
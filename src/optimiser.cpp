@@ -0,0 +1,206 @@
+#include "../include/optimiser.h"
+
+#include <mutex>
+#include <string>
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+
+using namespace llvm;
+
+// Where a remark points: its debug location when the code has one, else the
+// position a hinted loop was tagged with, else just the function.
+static std::string getRemarkLocation(const DiagnosticInfoIROptimization &DI) {
+  if (DI.isLocationAvailable()) {
+    return DI.getLocationStr();
+  }
+
+  const Function &F = DI.getFunction();
+  std::string file = F.getParent()->getSourceFileName();
+
+  // Loop passes report on the loop header; its latch holds the loop ID.
+  if (auto *header = dyn_cast_or_null<BasicBlock>(DI.getCodeRegion())) {
+    for (const BasicBlock *pred : predecessors(header)) {
+      const Instruction *term = pred->getTerminator();
+      MDNode *loopID = term ? term->getMetadata(LLVMContext::MD_loop) : nullptr;
+      MDNode *tag = loopID ? findOptionMDForLoopID(loopID, loopLocationTag)
+                           : nullptr;
+      if (tag && tag->getNumOperands() == 3) {
+        return file + ":" +
+               std::to_string(mdconst::extract<ConstantInt>(tag->getOperand(1))
+                                  ->getZExtValue()) +
+               ":" +
+               std::to_string(mdconst::extract<ConstantInt>(tag->getOperand(2))
+                                  ->getZExtValue());
+      }
+    }
+  }
+
+  return file + ": in function '" + F.getName().str() + "'";
+}
+
+namespace {
+// Prints the remarks an Optimiser's filter selects, and every failure to
+// honour a loop hint, the way clang does:
+//   loops.sl:3:5: remark: vectorized loop (...) [-Rpass=loop-vectorize]
+class RemarkPrinter : public DiagnosticHandler {
+ private:
+  const Regex *passed;
+  const Regex *missed;
+  const Regex *analysis;
+
+ public:
+  RemarkPrinter(const Regex *passed, const Regex *missed,
+                const Regex *analysis)
+      : passed(passed), missed(missed), analysis(analysis) {}
+
+  bool isPassedOptRemarkEnabled(StringRef pass) const override {
+    return passed && passed->match(pass);
+  }
+  bool isMissedOptRemarkEnabled(StringRef pass) const override {
+    return missed && missed->match(pass);
+  }
+  bool isAnalysisRemarkEnabled(StringRef pass) const override {
+    return analysis && analysis->match(pass);
+  }
+  bool isAnyRemarkEnabled() const override {
+    return passed || missed || analysis;
+  }
+
+  bool handleDiagnostics(const DiagnosticInfo &DI) override {
+    auto *remark = dyn_cast<DiagnosticInfoIROptimization>(&DI);
+    if (!remark) {
+      return false;
+    }
+
+    const char *severity = "remark";
+    const char *flag;
+    if (isa<OptimizationRemark>(remark)) {
+      flag = "-Rpass=";
+    } else if (isa<OptimizationRemarkMissed>(remark)) {
+      flag = "-Rpass-missed=";
+    } else if (isa<OptimizationRemarkAnalysis>(remark)) {
+      flag = "-Rpass-analysis=";
+    } else if (isa<DiagnosticInfoOptimizationFailure>(remark)) {
+      severity = "warning";
+      flag = "";
+    } else {
+      return false;
+    }
+
+    // Workers of a -j build optimise in parallel.
+    static std::mutex printLock;
+    std::lock_guard<std::mutex> guard(printLock);
+    errs() << getRemarkLocation(*remark) << ": " << severity << ": "
+           << remark->getMsg();
+    // Passes leave the name out of remarks explaining a forced loop hint,
+    // which are printed whatever the filter says.
+    if (!remark->getPassName().empty()) {
+      errs() << " [" << flag << remark->getPassName() << "]";
+    }
+    errs() << "\n";
+    return true;
+  }
+};
+}  // namespace
+
+Optimiser::Optimiser(OptimizationLevel level, TargetMachine *TM,
+                     const RemarkFilter &remarks)
+    : level(level), PB(TM) {
+  // The driver has checked the patterns.
+  if (!remarks.passed.empty()) {
+    passedRemarks = std::make_unique<Regex>(remarks.passed);
+  }
+  if (!remarks.missed.empty()) {
+    missedRemarks = std::make_unique<Regex>(remarks.missed);
+  }
+  if (!remarks.analysis.empty()) {
+    analysisRemarks = std::make_unique<Regex>(remarks.analysis);
+  }
+
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  if (level != OptimizationLevel::O0) {
+    FPM.addPass(PromotePass());
+    FPM.addPass(PB.buildFunctionSimplificationPipeline(
+        level, ThinOrFullLTOPhase::None));
+  }
+}
+
+// Cached results are keyed on the IR they describe, which the caller is
+// free to change or delete once a run is over.
+void Optimiser::clearAnalyses() {
+  LAM.clear();
+  FAM.clear();
+  CGAM.clear();
+  MAM.clear();
+}
+
+bool Optimiser::remarksEnabled() const {
+  return passedRemarks || missedRemarks || analysisRemarks;
+}
+
+// Runs passes with the remark printer as the context's diagnostic handler.
+void Optimiser::withRemarks(LLVMContext &context, function_ref<void()> run) {
+  std::unique_ptr<DiagnosticHandler> previous = context.getDiagnosticHandler();
+  context.setDiagnosticHandler(
+      std::make_unique<RemarkPrinter>(passedRemarks.get(), missedRemarks.get(),
+                                      analysisRemarks.get()),
+      true);
+  run();
+  context.setDiagnosticHandler(std::move(previous));
+}
+
+void Optimiser::runOnFunction(Function &F) {
+  if (level == OptimizationLevel::O0) {
+    return;
+  }
+
+  // The function pipeline never warns about loop hints; it only remarks.
+  if (remarksEnabled()) {
+    withRemarks(F.getContext(), [&]() { FPM.run(F, FAM); });
+  } else {
+    FPM.run(F, FAM);
+  }
+  clearAnalyses();
+}
+
+void Optimiser::runOnModule(Module &M) {
+  ModulePassManager MPM = level == OptimizationLevel::O0
+                              ? PB.buildO0DefaultPipeline(level)
+                              : PB.buildPerModuleDefaultPipeline(level);
+  withRemarks(M.getContext(), [&]() { MPM.run(M, MAM); });
+  clearAnalyses();
+}
+
+CodeGenOpt::Level getCodeGenOptLevel(OptimizationLevel level) {
+  switch (level.getSpeedupLevel()) {
+    case 0:
+      return CodeGenOpt::None;
+    case 1:
+      return CodeGenOpt::Less;
+    case 3:
+      return CodeGenOpt::Aggressive;
+    default:
+      return CodeGenOpt::Default;
+  }
+}
+
+std::string getOptLevelName(OptimizationLevel level) {
+  if (level.getSizeLevel() == 1) {
+    return "Os";
+  }
+  if (level.getSizeLevel() == 2) {
+    return "Oz";
+  }
+  return "O" + std::to_string(level.getSpeedupLevel());
+}
@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <thread>
+
+#include "../include/compilerSession.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/CodeGen/ParallelCG.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/Path.h"
+
+// Keeps a parsed definition for the workers. Its prototype is registered
+// now, in source order, so the workers see what a serial build would.
+void CompilerSession::queueDefinition(std::unique_ptr<FunctionAST> fn,
+                                      bool isTopLevel) {
+  PrototypeAST &p = *fn->proto;
+  registerPrototype(p);
+
+  unsigned order = functionProtos[p.name]->order;
+  queuedDefinitions.push_back({std::move(fn), p.name, order, isTopLevel});
+}
+
+// Lowers and optimises queued definitions [begin, end) into a module with
+// its own context, and returns it as bitcode. Runs on a worker thread and
+// only reads session state; the operator table is copied because lowering
+// caches Function pointers in it.
+void CompilerSession::lowerQueuedRange(size_t begin, size_t end,
+                                       SmallVector<char, 0> &bitcode) {
+  OperatorTable workerOperators = operators;
+  GenerateCode worker(*this, workerOperators);
+  worker.startModule(theJIT->getDataLayout());
+
+  for (size_t i = begin; i != end; i++) {
+    QueuedDefinition &def = queuedDefinitions[i];
+    worker.setVisiblePrototypes(def.order);
+    def.failed = !def.fn->Codegen(&worker);
+    def.fn.reset();
+  }
+
+  raw_svector_ostream OS(bitcode);
+  WriteBitcodeToFile(*worker.theModule, OS);
+}
+
+// Splits the queue into one contiguous range per thread and links the
+// results, in source order, into the session's module, which already holds
+// the externs.
+void CompilerSession::lowerQueuedDefinitions() {
+  if (queuedDefinitions.empty()) {
+    return;
+  }
+
+  size_t threads = std::min<size_t>(options.jobs, queuedDefinitions.size());
+  std::vector<SmallVector<char, 0>> chunks(threads);
+  std::vector<std::thread> workers;
+
+  size_t per = queuedDefinitions.size() / threads;
+  size_t extra = queuedDefinitions.size() % threads;
+  size_t begin = 0;
+  for (size_t t = 0; t < threads; t++) {
+    size_t end = begin + per + (t < extra ? 1 : 0);
+    workers.emplace_back([this, begin, end, &chunk = chunks[t]]() {
+      lowerQueuedRange(begin, end, chunk);
+    });
+    begin = end;
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  for (const QueuedDefinition &def : queuedDefinitions) {
+    if (def.failed) {
+      fprintf(stderr, def.isTopLevel
+                          ? "Error generating code for top level expression."
+                          : "Error reading function definition.");
+    } else {
+      definedFunctions.insert(def.name);
+    }
+  }
+  queuedDefinitions.clear();
+
+  Linker linker(*codeGenerator.theModule);
+  for (auto &chunk : chunks) {
+    auto M = parseBitcodeFile(
+        MemoryBufferRef(StringRef(chunk.data(), chunk.size()), "chunk"),
+        *codeGenerator.theContext);
+    if (!M) {
+      logAllUnhandledErrors(M.takeError(), errs(), "LogError: ");
+      continue;
+    }
+    if (linker.linkInModule(std::move(*M))) {
+      fprintf(stderr, "LogError: Could not link generated code\n");
+    }
+  }
+}
+
+// Partitions the finished module into options.splitParts modules, runs the
+// code generator on each in a thread of its own, and writes the objects out
+// as one archive. Symbols that were local become hidden globals so they can
+// be referenced across parts.
+void CompilerSession::emitSplitObjects() {
+  if (!getObjectTargetMachine()) {
+    return;
+  }
+
+  unsigned parts = options.splitParts;
+  std::vector<SmallVector<char, 0>> buffers(parts);
+  std::vector<std::unique_ptr<raw_svector_ostream>> streams;
+  std::vector<raw_pwrite_stream *> dests;
+  for (auto &buffer : buffers) {
+    streams.push_back(std::make_unique<raw_svector_ostream>(buffer));
+    dests.push_back(streams.back().get());
+  }
+
+  // Each part gets a target machine of its own.
+  splitCodeGen(
+      *codeGenerator.theModule, dests, {},
+      [this]() { return createTargetMachine(); }, CGFT_ObjectFile);
+
+  std::string stem = sys::path::stem(options.outFileName).str();
+  std::vector<std::unique_ptr<MemoryBuffer>> objects;
+  for (unsigned i = 0; i < parts; i++) {
+    objects.push_back(MemoryBuffer::getMemBufferCopy(
+        StringRef(buffers[i].data(), buffers[i].size()),
+        stem + "." + std::to_string(i) + ".o"));
+  }
+  writeObjectArchive(objects);
+}
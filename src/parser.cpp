@@ -1,85 +1,24 @@
 #include "../include/parser.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <mutex>
 
-#include "../include/JIT.h"
+#include "../include/compilerSession.h"
+#include "../include/multiversion.h"
+#include "../include/runtime.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Support/Path.h"
 
-extern int getToken();
+static ExitOnError exitOnErr;
 
-char curTok;
+int CompilerSession::getNextToken() { return curTok = lexer.getToken(); }
 
-std::map<char, int> binOpPrecedence;
-
-std::unique_ptr<LLVMContext> theContext;
-std::unique_ptr<IRBuilder<>> Builder;
-std::unique_ptr<Module> theModule;
-std::unique_ptr<legacy::FunctionPassManager> theFPM;
-std::unique_ptr<llvm::orc::SimpleJIT> theJIT;
-std::map<std::string, AllocaInst *> namedValues;
-std::map<std::string, std::unique_ptr<PrototypeAST>> functionProtos;
-ExitOnError exitOnErr;
-
-std::unique_ptr<DIBuilder> DBuilder;
-
-struct DebugInfo {
-  DICompileUnit *theCU;
-  DIType *doubleType;
-  std::vector<DIScope *> lexicalBlocks;
-
-  void emitLocation(ExprAST *AST);
-  DIType *getDoubleTy();
-};
-
-DIType *DebugInfo::getDoubleTy() {
-  if (doubleType) {
-    return doubleType;
-  } else {
-    doubleType = DBuilder->createBasicType("double", 64, dwarf::DW_ATE_float);
-    return doubleType;
-  }
-}
-
-void DebugInfo::emitLocation(ExprAST *AST) {
-  if (!AST) {
-    return Builder->SetCurrentDebugLocation(DebugLoc());
-  }
-  DIScope *scope;
-  if (lexicalBlocks.empty()) {
-    scope = theCU;
-  } else {
-    scope = lexicalBlocks.back();
-  }
-  Builder->SetCurrentDebugLocation(DILocation::get(
-      scope->getContext(), AST->getLine(), AST->getCol(), scope));
-}
-
-DebugInfo debugInfo;
-
-GenerateCode codeGenerator;
-
-int tempResolveTopLvlExpr = 0;
-
-std::unique_ptr<ExprAST> parseNumberExpr();
-std::unique_ptr<ExprAST> parseParenExpr();
-std::unique_ptr<ExprAST> parsePrimary();
-std::unique_ptr<ExprAST> parseBinOpRHS(int exprPrec,
-                                       std::unique_ptr<ExprAST> LHS);
-std::unique_ptr<ExprAST> parseExpression();
-std::unique_ptr<ExprAST> parseIdentifierExpr();
-std::unique_ptr<PrototypeAST> parseProtoype();
-std::unique_ptr<FunctionAST> parseDefinition();
-std::unique_ptr<PrototypeAST> parseExtern();
-std::unique_ptr<ExprAST> parseUnaryExpr();
-std::unique_ptr<FunctionAST> parseTopLvlExpr();
-std::unique_ptr<ExprAST> parseIfExpr();
-std::unique_ptr<ExprAST> parseForExpr();
-std::unique_ptr<ExprAST> parseVarExpr();
-
-AllocaInst *createEntryBlockAlloca(Function *theFunction, std::string varName);
-
-int getNextToken() { return curTok = getToken(); }
-
-std::unique_ptr<ExprAST> logError(const char *str) {
+ExprAST *logError(const char *str) {
   fprintf(stderr, "LogError: %s\n", str);
   return nullptr;
 }
@@ -89,15 +28,37 @@ std::unique_ptr<PrototypeAST> logErrorP(const char *str) {
   return nullptr;
 }
 
-std::unique_ptr<ExprAST> parseNumberExpr() {
-  auto result = std::make_unique<NumberExprAST>(numVal);
+static bool isComparison(int op) {
+  return op == '<' || op == '>' || op == tok_le || op == tok_ge ||
+         op == tok_eq || op == tok_ne;
+}
+
+static bool isLogical(int op) { return op == tok_and || op == tok_or; }
+
+// Name of the function implementing a user-defined operator, e.g. "binary|".
+static Symbol getOperatorSymbol(SymbolTable &symbols, StringRef kind,
+                                char op) {
+  char name[16];
+  assert(kind.size() < sizeof(name));
+  memcpy(name, kind.data(), kind.size());
+  name[kind.size()] = op;
+  return symbols.intern(StringRef(name, kind.size() + 1));
+}
+
+ExprAST *CompilerSession::parseNumberExpr() {
+  // The lexer has already reported a malformed literal.
+  if (!lexer.numValid) {
+    return nullptr;
+  }
+
+  auto result = astArena->create<NumberExprAST>(lexer.curLoc, lexer.numVal);
   getNextToken();
-  return std::move(result);
+  return result;
 }
 
-std::unique_ptr<ExprAST> parseParenExpr() {
+ExprAST *CompilerSession::parseParenExpr() {
   getNextToken();
-  auto V = std::move(parseExpression());
+  auto V = parseExpression();
   if (!V) {
     return nullptr;
   }
@@ -106,52 +67,40 @@ std::unique_ptr<ExprAST> parseParenExpr() {
     return logError("Expected ')'");
   } else {
     getNextToken();
-    return std::move(V);
+    return V;
   }
 }
 
-std::unique_ptr<ExprAST> parsePrimary() {
+ExprAST *CompilerSession::parsePrimary() {
   switch (curTok) {
-    case tok_identifier:
-      return std::move(parseIdentifierExpr());
     case tok_number:
-      return std::move(parseNumberExpr());
-    case '(':
-      return std::move(parseParenExpr());
+      return parseNumberExpr();
     case tok_if:
-      return std::move(parseIfExpr());
+      return parseIfExpr();
     case tok_for:
-      return std::move(parseForExpr());
+      return parseForExpr();
     case tok_var:
-      return std::move(parseVarExpr());
+      return parseVarExpr();
     default:
       return logError("Unknown token when expecting an expression");
   }
 }
 
-std::unique_ptr<ExprAST> parseUnaryExpr() {
-  if (!isascii(curTok) || curTok == '(') {
-    return parsePrimary();
-  }
-
-  int opc = curTok;
+ExprAST *CompilerSession::parseForExpr() {
+  SourceLocation forLoc = lexer.curLoc;
   getNextToken();
 
-  if (auto operand = parseUnaryExpr()) {
-    return std::make_unique<UnaryExprAST>(opc, std::move(operand));
+  LoopHints hints;
+  if (curTok == '[' && !parseLoopHints(hints)) {
+    return nullptr;
   }
-  return nullptr;
-}
-
-std::unique_ptr<ExprAST> parseForExpr() {
-  getNextToken();
 
   if (curTok != tok_identifier) {
     logError("Expected a variable name after for");
     return nullptr;
   }
 
-  std::string idName = identifierStr;
+  Symbol idName = lexer.identifierSym;
   getNextToken();
 
   if (curTok != '=') {
@@ -176,7 +125,7 @@ std::unique_ptr<ExprAST> parseForExpr() {
     return nullptr;
   }
 
-  std::unique_ptr<ExprAST> step;
+  ExprAST *step = nullptr;
   if (curTok == tok_inc) {
     getNextToken();
     step = parseExpression();
@@ -200,65 +149,144 @@ std::unique_ptr<ExprAST> parseForExpr() {
     return nullptr;
   }
 
-  return std::make_unique<ForExprAST>(idName, std::move(start), std::move(cond),
-                                      std::move(step), std::move(body));
+  return astArena->create<ForExprAST>(forLoc, idName, start, cond, step, body,
+                                      hints);
 }
 
-std::unique_ptr<ExprAST> parseVarExpr() {
+// Parses `[hint, ...]` after for. Counts must be whole numbers the loop
+// optimisers accept.
+bool CompilerSession::parseLoopHints(LoopHints &hints) {
   getNextToken();
 
-  std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> vars;
-
-  if (curTok != tok_identifier) {
-    return logError("Expected identifier after var");
-  }
-
   while (true) {
-    std::string name = identifierStr;
+    if (curTok != tok_identifier) {
+      logError("Expected a loop hint");
+      return false;
+    }
+    StringRef name = symbols.str(lexer.identifierSym);
     getNextToken();
 
-    std::unique_ptr<ExprAST> init;
-    if (curTok == '=') {
-      getNextToken();
+    if (name == "novectorize") {
+      hints.noVectorize = true;
+    } else {
+      unsigned *count = nullptr;
+      unsigned limit = 0;
+      if (name == "unroll") {
+        count = &hints.unrollCount;
+        limit = 1024;
+      } else if (name == "vectorize") {
+        count = &hints.vectorizeWidth;
+        limit = 64;
+      } else if (name == "interleave") {
+        count = &hints.interleaveCount;
+        limit = 16;
+      } else {
+        logError("Unknown loop hint");
+        return false;
+      }
 
-      init = std::move(parseExpression());
-      if (!init) {
-        return nullptr;
+      double val = lexer.numVal;
+      if (curTok != tok_number || val < 1 || val > limit ||
+          val != (unsigned)val) {
+        fprintf(stderr,
+                "LogError: Expected a whole number from 1 to %u after %s\n",
+                limit, name.str().c_str());
+        return false;
+      }
+      *count = (unsigned)val;
+      if (name == "vectorize" && !isPowerOf2_32(*count)) {
+        logError("The vectorize width must be a power of two");
+        return false;
       }
+      getNextToken();
     }
 
-    vars.push_back(std::make_pair(name, std::move(init)));
-
-    if (curTok != ',') {
+    if (curTok == ']') {
       break;
     }
+    if (curTok != ',') {
+      logError("Expected ',' or ']' in loop hints");
+      return false;
+    }
+    getNextToken();
+  }
+  getNextToken();
+
+  if (hints.noVectorize && (hints.vectorizeWidth || hints.interleaveCount)) {
+    logError("novectorize cannot be combined with vectorize or interleave");
+    return false;
+  }
+  return true;
+}
 
+// A `var ... in var ... in` chain is read in one loop rather than one call
+// per level, since generated code nests them thousands deep.
+ExprAST *CompilerSession::parseVarExpr() {
+  SmallVector<ArrayRef<VarBinding>, 4> levels;
+  SmallVector<SourceLocation, 4> levelLocs;
+  SmallVector<VarBinding, 4> vars;
+
+  do {
+    levelLocs.push_back(lexer.curLoc);
     getNextToken();
+    vars.clear();
 
     if (curTok != tok_identifier) {
       return logError("Expected identifier after var");
     }
-  }
 
-  if (curTok != tok_in) {
-    return logError("Expected in after var");
-  }
-  getNextToken();
+    while (true) {
+      Symbol name = lexer.identifierSym;
+      getNextToken();
+
+      ExprAST *init = nullptr;
+      if (curTok == '=') {
+        getNextToken();
+
+        init = parseExpression();
+        if (!init) {
+          return nullptr;
+        }
+      }
+
+      vars.push_back({name, init});
+
+      if (curTok != ',') {
+        break;
+      }
+
+      getNextToken();
+
+      if (curTok != tok_identifier) {
+        return logError("Expected identifier after var");
+      }
+    }
+
+    if (curTok != tok_in) {
+      return logError("Expected in after var");
+    }
+    getNextToken();
+
+    levels.push_back(astArena->copy<VarBinding>(vars));
+  } while (curTok == tok_var);
 
   auto body = parseExpression();
   if (!body) {
     return nullptr;
   }
 
-  return std::make_unique<VarExprAST>(std::move(vars), std::move(body));
+  for (size_t i = levels.size(); i-- > 0;) {
+    body = astArena->create<VarExprAST>(levelLocs[i], levels[i], body);
+  }
+  return body;
 }
 
-int getTokPrecedence() {
-  if (!isascii(curTok)) {
+int CompilerSession::getTokPrecedence() {
+  if (!isascii(curTok) && !isOperatorToken(curTok)) {
     return -1;
   }
 
-  int tokPrec = binOpPrecedence[curTok];
+  int tokPrec = operators[curTok].precedence;
 
   if (tokPrec <= 0) {
     return -1;
@@ -267,91 +295,151 @@ int getTokPrecedence() {
   return tokPrec;
 }
 
-std::unique_ptr<ExprAST> parseBinOpRHS(int exprPrec,
-                                       std::unique_ptr<ExprAST> LHS) {
-  while (true) {
-    int tokPrec = getTokPrecedence();
+namespace {
+// An operator or bracket whose operands are still being parsed.
+struct PendingOp {
+  enum Kind { Unary, Binary, Paren, Call } kind;
+  int op;
+  int prec;
+  SourceLocation loc;
+  Symbol callee;
+  size_t argBase;
+};
+}  // namespace
+
+// Parses an expression with explicit operand and operator stacks instead of
+// recursing once per nesting level, so parentheses, calls, unary chains and
+// operator chains nest as deep as memory allows. Only if/for/var re-enter
+// the parser for their sub-expressions; a var chain does so once.
+ExprAST *CompilerSession::parseExpression() {
+  SmallVector<ExprAST *, 16> operands;
+  SmallVector<PendingOp, 16> ops;
+
+  auto reduceTop = [&]() {
+    PendingOp top = ops.pop_back_val();
+    ExprAST *RHS = operands.pop_back_val();
+    if (top.kind == PendingOp::Unary) {
+      operands.push_back(astArena->create<UnaryExprAST>(top.loc, top.op, RHS));
+    } else {
+      ExprAST *LHS = operands.pop_back_val();
+      operands.push_back(
+          astArena->create<BinaryExprAST>(top.loc, top.op, LHS, RHS));
+    }
+  };
 
-    if (tokPrec < exprPrec)  // to check if this is really a binary operator as
-                             // invalid tokens have precedence of -1
-    {
-      return std::move(LHS);
+  // Prefix operators apply as soon as their operand is complete.
+  auto finishOperand = [&]() {
+    while (!ops.empty() && ops.back().kind == PendingOp::Unary) {
+      reduceTop();
     }
+  };
 
-    int binOp = curTok;
-    SourceLocation binLoc = curLoc;
+  // Folds the binary operators above the innermost open '(' or call.
+  auto reduceToBracket = [&]() {
+    while (!ops.empty() && ops.back().kind == PendingOp::Binary) {
+      reduceTop();
+    }
+  };
+
+  auto closeCall = [&]() {
+    PendingOp call = ops.pop_back_val();
+    auto args = astArena->copy<ExprAST *>(
+        makeArrayRef(operands).drop_front(call.argBase));
+    operands.resize(call.argBase);
+    operands.push_back(
+        astArena->create<CallExprAST>(call.loc, call.callee, args));
     getNextToken();
+  };
 
-    auto RHS = parseUnaryExpr();
+  bool expectOperand = true;
+  while (true) {
+    if (expectOperand) {
+      if (curTok == '(') {
+        ops.push_back({PendingOp::Paren, '(', 0, lexer.curLoc, 0, 0});
+        getNextToken();
+        continue;
+      }
 
-    if (!RHS) {
-      return nullptr;
-    }
+      if (curTok == ')' && !ops.empty() &&
+          ops.back().kind == PendingOp::Call &&
+          ops.back().argBase == operands.size()) {
+        closeCall();
+      } else if (isascii(curTok)) {
+        ops.push_back({PendingOp::Unary, curTok, 0, lexer.curLoc, 0, 0});
+        getNextToken();
+        continue;
+      } else if (curTok == tok_identifier) {
+        Symbol idName = lexer.identifierSym;
+        SourceLocation litLoc = lexer.curLoc;
 
-    int nextPrec = getTokPrecedence();
+        getNextToken();
+        if (curTok == '(') {
+          ops.push_back(
+              {PendingOp::Call, 0, 0, litLoc, idName, operands.size()});
+          getNextToken();
+          continue;
+        }
+        operands.push_back(astArena->create<VariableExprAST>(litLoc, idName));
+      } else {
+        ExprAST *primary = parsePrimary();
+        if (!primary) {
+          return nullptr;
+        }
+        operands.push_back(primary);
+      }
 
-    if (tokPrec < nextPrec) {
-      RHS = parseBinOpRHS(tokPrec + 1, std::move(RHS));
+      finishOperand();
+      expectOperand = false;
+      continue;
+    }
 
-      if (!RHS) {
-        return nullptr;
+    int tokPrec = getTokPrecedence();
+    if (tokPrec > 0) {
+      // An equal-precedence operator on the stack binds first unless the
+      // incoming operator is right-associative.
+      int minPrec = operators[curTok].rightAssoc ? tokPrec + 1 : tokPrec;
+      while (!ops.empty() && ops.back().kind == PendingOp::Binary &&
+             ops.back().prec >= minPrec) {
+        reduceTop();
       }
+      ops.push_back({PendingOp::Binary, curTok, tokPrec, lexer.curLoc, 0, 0});
+      getNextToken();
+      expectOperand = true;
+      continue;
     }
 
-    LHS = std::make_unique<BinaryExprAST>(binLoc, binOp, std::move(LHS),
-                                          std::move(RHS));
-  }
-}
-
-std::unique_ptr<ExprAST> parseExpression() {
-  auto LHS = std::move(parseUnaryExpr());
-
-  if (!LHS) {
-    return nullptr;
-  }
-
-  return std::move(parseBinOpRHS(0, std::move(LHS)));
-}
-
-std::unique_ptr<ExprAST> parseIdentifierExpr() {
-  std::string idName = identifierStr;
-  SourceLocation litLoc = curLoc;
-
-  getNextToken();
-  if (curTok != '(') {
-    return std::make_unique<VariableExprAST>(litLoc, idName);
-  }
-  getNextToken();
-
-  std::vector<std::unique_ptr<ExprAST>> args;
-
-  if (curTok != ')') {
-    while (true) {
-      if (auto arg = parseExpression()) {
-        args.push_back(std::move(arg));
-      } else {
-        return nullptr;
-      }
+    reduceToBracket();
+    if (ops.empty()) {
+      break;
+    }
 
+    if (ops.back().kind == PendingOp::Call) {
       if (curTok == ')') {
-        break;
+        closeCall();
+        finishOperand();
+        continue;
       }
-
       if (curTok != ',') {
         return logError("Expected ',' after an argument in function call");
       }
-
       getNextToken();
+      expectOperand = true;
+      continue;
     }
-  }
 
-  getNextToken();
+    if (curTok != ')') {
+      return logError("Expected ')'");
+    }
+    ops.pop_back();
+    getNextToken();
+    finishOperand();
+  }
 
-  return std::make_unique<CallExprAST>(litLoc, idName, std::move(args));
+  return operands.back();
 }
 
-std::unique_ptr<ExprAST> parseIfExpr() {
-  SourceLocation ifLoc = curLoc;
+ExprAST *CompilerSession::parseIfExpr() {
+  SourceLocation ifLoc = lexer.curLoc;
 
   getNextToken();
 
@@ -392,14 +480,13 @@ std::unique_ptr<ExprAST> parseIfExpr() {
     return nullptr;
   }
 
-  return std::make_unique<IfExprAST>(ifLoc, std::move(cond), std::move(then),
-                                     std::move(_else));
+  return astArena->create<IfExprAST>(ifLoc, cond, then, _else);
 }
 
-std::unique_ptr<PrototypeAST> parseProtoype() {
-  std::string fnName;
+std::unique_ptr<PrototypeAST> CompilerSession::parseProtoype() {
+  Symbol fnName;
 
-  SourceLocation fnLoc = curLoc;
+  SourceLocation fnLoc = lexer.curLoc;
 
   unsigned kind = 0;
   unsigned binaryPrecedence = 30;
@@ -409,7 +496,7 @@ std::unique_ptr<PrototypeAST> parseProtoype() {
       return logErrorP("Expected function name in prototype");
       break;
     case tok_identifier:
-      fnName = identifierStr;
+      fnName = lexer.identifierSym;
       kind = 0;
       getNextToken();
       break;
@@ -418,16 +505,18 @@ std::unique_ptr<PrototypeAST> parseProtoype() {
       if (!isascii(curTok)) {
         return logErrorP("Expected binary operator");
       }
-      fnName = "binary";
-      fnName.push_back(curTok);
+      if (isBuiltinBinaryOp(curTok)) {
+        return logErrorP("Built-in binary operators cannot be redefined");
+      }
+      fnName = getOperatorSymbol(symbols, "binary", curTok);
       kind = 2;
       getNextToken();
 
       if (curTok == tok_number) {
-        if (numVal < 1 || numVal > 100) {
+        if (lexer.numVal < 1 || lexer.numVal > 100) {
           return logErrorP("Precedence must be from 1 to 100");
         }
-        binaryPrecedence = (unsigned)numVal;
+        binaryPrecedence = (unsigned)lexer.numVal;
         getNextToken();
       }
       break;
@@ -436,8 +525,7 @@ std::unique_ptr<PrototypeAST> parseProtoype() {
       if (!isascii(curTok)) {
         return logErrorP("Expected unary operator");
       }
-      fnName = "unary";
-      fnName.push_back(curTok);
+      fnName = getOperatorSymbol(symbols, "unary", curTok);
       kind = 1;
       getNextToken();
   }
@@ -446,15 +534,12 @@ std::unique_ptr<PrototypeAST> parseProtoype() {
     return logErrorP("Expected '(' in function prototype");
   }
 
-  std::vector<std::unique_ptr<ExprAST>> argNames;
-  std::vector<std::string> argString;
+  std::vector<Symbol> argNames;
 
   int tok = getNextToken();
 
   while (tok == tok_identifier) {
-    argNames.push_back(
-        std::move(std::make_unique<VariableExprAST>(fnLoc, identifierStr)));
-    argString.push_back(identifierStr);
+    argNames.push_back(lexer.identifierSym);
 
     tok = getNextToken();
     if (tok != ')') {
@@ -475,40 +560,94 @@ std::unique_ptr<PrototypeAST> parseProtoype() {
     return logErrorP("Invalid number of operands for an operator");
   }
 
-  return std::make_unique<PrototypeAST>(fnLoc, fnName, std::move(argNames),
-                                        std::move(argString), kind != 0,
+  return std::make_unique<PrototypeAST>(fnLoc, fnName, symbols.str(fnName),
+                                        std::move(argNames), kind != 0,
                                         binaryPrecedence);
 }
 
-std::unique_ptr<FunctionAST> parseDefinition() {
+std::unique_ptr<FunctionAST> CompilerSession::parseDefinition() {
   getNextToken();
 
-  auto proto = std::move(parseProtoype());
+  bool fastMath = false;
+  if (curTok == '[' && !parseDefinitionAttributes(fastMath)) {
+    return nullptr;
+  }
+
+  auto proto = parseProtoype();
   if (!proto) {
     return nullptr;
   }
+  proto->fastMath = fastMath;
 
-  if (auto exp = std::move(parseExpression())) {
-    return std::make_unique<FunctionAST>(std::move(proto), std::move(exp));
+  auto arena = std::make_unique<ASTArena>();
+  astArena = arena.get();
+
+  ExprAST *exp = parseExpression();
+  astBytes += arena->getBytesAllocated();
+  if (exp) {
+    // The rest of the file may use the operator right away, so it gets its
+    // precedence before the definition is lowered; rejectOperator() takes it
+    // back if lowering fails.
+    if (proto->isBinaryOp()) {
+      proto->precedenceHandle = (int)operators.defineBinary(
+          proto->getOperatorName(), proto->precedence);
+    }
+    return std::make_unique<FunctionAST>(std::move(proto), exp,
+                                         std::move(arena));
   }
 
   return nullptr;
 }
 
-std::unique_ptr<PrototypeAST> parseExtern() {
+// Parses `[attribute, ...]` after def. The only attribute so far is
+// fastmath, which relaxes the definition's floating-point arithmetic the
+// way -ffast-math does for the whole file.
+bool CompilerSession::parseDefinitionAttributes(bool &fastMath) {
+  getNextToken();
+
+  while (true) {
+    if (curTok != tok_identifier ||
+        symbols.str(lexer.identifierSym) != "fastmath") {
+      logError("Expected fastmath in definition attributes");
+      return false;
+    }
+    fastMath = true;
+    getNextToken();
+
+    if (curTok == ']') {
+      break;
+    }
+    if (curTok != ',') {
+      logError("Expected ',' or ']' in definition attributes");
+      return false;
+    }
+    getNextToken();
+  }
+  getNextToken();
+
+  return true;
+}
+
+std::unique_ptr<PrototypeAST> CompilerSession::parseExtern() {
   getNextToken();
 
-  return std::move(parseProtoype());
+  return parseProtoype();
 }
 
-std::unique_ptr<FunctionAST> parseTopLvlExpr() {
-  SourceLocation exprLoc = curLoc;
+std::unique_ptr<FunctionAST> CompilerSession::parseTopLvlExpr() {
+  SourceLocation exprLoc = lexer.curLoc;
+
+  auto arena = std::make_unique<ASTArena>();
+  astArena = arena.get();
 
-  if (auto exp = std::move(parseExpression())) {
+  ExprAST *exp = parseExpression();
+  astBytes += arena->getBytesAllocated();
+  if (exp) {
+    Symbol mainSym = symbols.intern("main");
     auto proto = std::make_unique<PrototypeAST>(
-        exprLoc, "main", std::move(std::vector<std::unique_ptr<ExprAST>>()),
-        std::move(std::vector<std::string>()));
-    return std::make_unique<FunctionAST>(std::move(proto), std::move(exp));
+        exprLoc, mainSym, symbols.str(mainSym), std::vector<Symbol>());
+    return std::make_unique<FunctionAST>(std::move(proto), exp,
+                                         std::move(arena));
   }
 
   return nullptr;
@@ -516,16 +655,94 @@ std::unique_ptr<FunctionAST> parseTopLvlExpr() {
 
 // CODE GENERATION:
 
-AllocaInst *createEntryBlockAlloca(Function *theFunction, std::string varName) {
+GenerateCode::GenerateCode(CompilerSession &session)
+    : options(session.options),
+      symbols(session.symbols),
+      operators(session.operators),
+      functionProtos(session.functionProtos),
+      optimiser(std::make_unique<Optimiser>(session.options.optLevel, nullptr,
+                                            session.options.remarks)) {}
+
+GenerateCode::GenerateCode(CompilerSession &session, OperatorTable &operators)
+    : options(session.options),
+      symbols(session.symbols),
+      operators(operators),
+      functionProtos(session.functionProtos),
+      optimiser(std::make_unique<Optimiser>(session.options.optLevel, nullptr,
+                                            session.options.remarks)) {}
+
+GenerateCode::~GenerateCode() = default;
+
+// Starts an empty module with its own context. In -run mode every finished
+// module is handed to the JIT, so this runs again after each hand-off.
+void GenerateCode::startModule(const DataLayout &DL) {
+  // Whatever is left of the previous module goes before its context.
+  Builder.reset();
+  theModule.reset();
+
+  theContext = std::make_unique<LLVMContext>();
+  theModule = std::make_unique<Module>("FirstLang", *theContext);
+  theModule->setDataLayout(DL);
+  // Remarks without debug info name the file through this.
+  if (!options.fileName.empty()) theModule->setSourceFileName(options.fileName);
+  Builder = std::make_unique<IRBuilder<>>(*theContext);
+
+  operators.forgetFunctions();
+}
+
+void GenerateCode::initializeDwarf(StringRef fileName) {
+  theModule->addModuleFlag(Module::Warning, "Debug Info Version",
+                           DEBUG_METADATA_VERSION);
+
+  if (Triple(sys::getProcessTriple()).isOSDarwin()) {
+    theModule->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 2);
+  }
+  DBuilder = std::make_unique<DIBuilder>(*theModule);
+
+  debugInfo.theCU = DBuilder->createCompileUnit(
+      dwarf::DW_LANG_C, DBuilder->createFile(fileName, "."),
+      "SimpleLang Compiler", !options.enableDebug, "", 0);
+}
+
+void GenerateCode::finalizeDwarf() {
+  if (DBuilder) DBuilder->finalize();
+}
+
+DIType *GenerateCode::getDebugDoubleTy() {
+  if (debugInfo.doubleType) {
+    return debugInfo.doubleType;
+  } else {
+    debugInfo.doubleType =
+        DBuilder->createBasicType("double", 64, dwarf::DW_ATE_float);
+    return debugInfo.doubleType;
+  }
+}
+
+void GenerateCode::emitLocation(ExprAST *AST) {
+  if (!AST) {
+    return Builder->SetCurrentDebugLocation(DebugLoc());
+  }
+  DIScope *scope;
+  if (debugInfo.lexicalBlocks.empty()) {
+    scope = debugInfo.theCU;
+  } else {
+    scope = debugInfo.lexicalBlocks.back();
+  }
+  Builder->SetCurrentDebugLocation(DILocation::get(
+      scope->getContext(), AST->getLine(), AST->getCol(), scope));
+}
+
+AllocaInst *GenerateCode::createEntryBlockAlloca(Function *theFunction,
+                                                StringRef varName) {
   IRBuilder<> tmpB(&theFunction->getEntryBlock(),
                    theFunction->getEntryBlock().begin());
 
   return tmpB.CreateAlloca(Type::getDoubleTy(*theContext), 0, varName);
 }
 
-DISubroutineType *createFunctionType(unsigned numArgs) {
+DISubroutineType *GenerateCode::createFunctionType(unsigned numArgs) {
   SmallVector<Metadata *, 8> eltTypes;
-  DIType *doubleType = debugInfo.getDoubleTy();
+  DIType *doubleType = getDebugDoubleTy();
 
   eltTypes.push_back(doubleType);
 
@@ -537,14 +754,14 @@ DISubroutineType *createFunctionType(unsigned numArgs) {
       DBuilder->getOrCreateTypeArray(eltTypes));
 }
 
-Function *getFunction(std::string name) {
-  if (auto *F = theModule->getFunction(name)) {
+Function *GenerateCode::getFunction(Symbol name) {
+  if (auto *F = theModule->getFunction(symbols.str(name))) {
     return F;
   }
 
   auto FI = functionProtos.find(name);
-  if (FI != functionProtos.end()) {
-    return FI->second->Codegen(&codeGenerator);
+  if (FI != functionProtos.end() && FI->second->order <= lastVisibleProto) {
+    return Codegen(FI->second.get());
   } else {
     return nullptr;
   }
@@ -555,63 +772,158 @@ Value *logErrorV(const char *str) {
   return nullptr;
 }
 
+// Lowers an expression with an explicit work stack rather than recursing per
+// nesting level, so operator, unary and call chains of any depth are safe.
+// if, for and var bring their own control flow and scopes and are lowered by
+// their overloads, which come back here for their sub-expressions.
+Value *GenerateCode::codegen(ExprAST *root) {
+  struct Frame {
+    ExprAST *node;
+    unsigned next;  // children lowered so far
+    Function *callee;
+  };
+
+  SmallVector<Frame, 32> work;
+  SmallVector<Value *, 32> values;
+  work.push_back({root, 0, nullptr});
+
+  while (!work.empty()) {
+    Frame &frame = work.back();
+    Value *result = nullptr;
+
+    switch (frame.node->getKind()) {
+      case ExprAST::EK_Number:
+        result = codegen(cast<NumberExprAST>(frame.node));
+        break;
+      case ExprAST::EK_Variable:
+        result = codegen(cast<VariableExprAST>(frame.node));
+        break;
+      case ExprAST::EK_Var:
+        result = codegen(cast<VarExprAST>(frame.node));
+        break;
+      case ExprAST::EK_If:
+        result = codegen(cast<IfExprAST>(frame.node));
+        break;
+      case ExprAST::EK_For:
+        result = codegen(cast<ForExprAST>(frame.node));
+        break;
+      case ExprAST::EK_Binary: {
+        auto *a = cast<BinaryExprAST>(frame.node);
+        if (frame.next == 0) {
+          if (options.printDebug) emitLocation(a);
+          if (isLogical(a->op)) {
+            result = emitLogicalValue(a);
+            break;
+          }
+          if (a->op == '=') {
+            if (!isa<VariableExprAST>(a->LHS)) {
+              return logErrorV("LHS of '=' must be a variable");
+            }
+            frame.next = 2;
+            work.push_back({a->RHS, 0, nullptr});
+          } else {
+            frame.next = 1;
+            work.push_back({a->LHS, 0, nullptr});
+          }
+          continue;
+        }
+        if (frame.next == 1) {
+          if (a->op == ':') {
+            values.pop_back();
+          }
+          frame.next = 2;
+          work.push_back({a->RHS, 0, nullptr});
+          continue;
+        }
+
+        Value *R = values.pop_back_val();
+        if (a->op == ':') {
+          result = R;
+        } else if (a->op == '=') {
+          result = emitAssignment(a, R);
+        } else {
+          Value *L = values.pop_back_val();
+          result = emitBinaryOp(a, L, R);
+        }
+        break;
+      }
+      case ExprAST::EK_Unary: {
+        auto *a = cast<UnaryExprAST>(frame.node);
+        if (frame.next == 0) {
+          frame.next = 1;
+          work.push_back({a->operand, 0, nullptr});
+          continue;
+        }
+        result = emitUnaryOp(a, values.pop_back_val());
+        break;
+      }
+      case ExprAST::EK_Call: {
+        auto *a = cast<CallExprAST>(frame.node);
+        if (frame.next == 0 && !frame.callee) {
+          if (options.printDebug) emitLocation(a);
+
+          frame.callee = getFunction(a->callee);
+          if (!frame.callee) {
+            return logErrorV("Unknown function referenced");
+          }
+
+          if (frame.callee->arg_size() != a->args.size()) {
+            return logErrorV("Incorrect number of arguments passed");
+          }
+        }
+        if (frame.next < a->args.size()) {
+          work.push_back({a->args[frame.next++], 0, nullptr});
+          continue;
+        }
+
+        ArrayRef<Value *> argsV =
+            makeArrayRef(values).take_back(a->args.size());
+        result = Builder->CreateCall(frame.callee, argsV, "calltmp");
+        values.resize(values.size() - a->args.size());
+        break;
+      }
+    }
+
+    if (!result) {
+      return nullptr;
+    }
+    work.pop_back();
+    values.push_back(result);
+  }
+
+  return values.back();
+}
+
 Value *GenerateCode::codegen(NumberExprAST *a) {
-  if (printDebug) debugInfo.emitLocation(a);
+  if (options.printDebug) emitLocation(a);
   return ConstantFP::get(*theContext, APFloat(a->val));
 }
 
 Value *GenerateCode::codegen(VariableExprAST *a) {
-  AllocaInst *A = namedValues[a->name];
+  AllocaInst *A = namedValues.lookup(a->name);
   if (!A) {
     logErrorV("Unknown variable name.");
     return nullptr;
   }
 
-  if (printDebug) debugInfo.emitLocation(a);
-  return Builder->CreateLoad(A->getAllocatedType(), A,
-                             llvm::StringRef(a->name));
+  if (options.printDebug) emitLocation(a);
+  return Builder->CreateLoad(A->getAllocatedType(), A, symbols.str(a->name));
 }
 
-Value *GenerateCode::codegen(BinaryExprAST *a) {
-  if (printDebug) debugInfo.emitLocation(a);
-
-  if (a->op == ':') {
-    Value *L = a->LHS->codegen(this);
-    if (!L) {
-      return nullptr;
-    }
-
-    return a->RHS->codegen(this);
-  }
-  if (a->op == '=') {
-    VariableExprAST *LHSe = static_cast<VariableExprAST *>(a->LHS.get());
-    if (!LHSe) {
-      return logErrorV("LHS of '=' must be a variable");
-    }
-
-    Value *val = a->RHS->codegen(this);
-    if (!val) {
-      return nullptr;
-    }
-
-    AllocaInst *variable = namedValues[LHSe->name];
-
-    if (!variable) {
-      return logErrorV("Unknown variable name");
-    }
-
-    Builder->CreateStore(val, variable);
+Value *GenerateCode::emitAssignment(BinaryExprAST *a, Value *val) {
+  auto *LHSe = cast<VariableExprAST>(a->LHS);
+  AllocaInst *variable = namedValues.lookup(LHSe->name);
 
-    return val;
+  if (!variable) {
+    return logErrorV("Unknown variable name");
   }
 
-  Value *L = a->LHS->codegen(this);
-  Value *R = a->RHS->codegen(this);
+  Builder->CreateStore(val, variable);
 
-  if (!L || !R) {
-    return nullptr;
-  }
+  return val;
+}
 
+Value *GenerateCode::emitBinaryOp(BinaryExprAST *a, Value *L, Value *R) {
   switch (a->op) {
     case '+':
       return Builder->CreateFAdd(L, R, "addtmp");
@@ -620,84 +932,219 @@ Value *GenerateCode::codegen(BinaryExprAST *a) {
     case '*':
       return Builder->CreateFMul(L, R, "multemp");
     case '<':
-      L = Builder->CreateFCmpULT(L, R, "cmptmp");
-      return Builder->CreateUIToFP(L, Type::getDoubleTy(*theContext),
-                                   "booltmp");
+    case '>':
+    case tok_le:
+    case tok_ge:
+    case tok_eq:
+    case tok_ne:
+      // The comparison's value is used as a number, so it becomes one.
+      return Builder->CreateUIToFP(emitComparison(a->op, L, R),
+                                   Type::getDoubleTy(*theContext), "booltmp");
     default:
       break;
   }
 
-  Function *F = getFunction(std::string("binary") + a->op);
+  OperatorInfo &info = operators[a->op];
+  Function *F = info.binaryFn;
   if (!F) {
-    return logErrorV("Binary operator not found");
+    // Operators only declared with extern are resolved on first use.
+    if (info.binaryName != noOperatorFn) {
+      F = info.binaryFn = getFunction(info.binaryName);
+    }
+    if (!F) {
+      return logErrorV("Binary operator not found");
+    }
   }
 
   Value *ops[2] = {L, R};
   return Builder->CreateCall(F, ops, "binop");
 }
 
-Value *GenerateCode::codegen(UnaryExprAST *a) {
-  Value *operandV = a->operand->codegen(this);
-  if (!operandV) {
-    return nullptr;
+// Comparisons are unordered, so a NaN operand makes them hold, as '<'
+// always has, except for ==, which only holds for equal numbers; != is its
+// negation.
+Value *GenerateCode::emitComparison(int op, Value *L, Value *R) {
+  switch (op) {
+    case '<':
+      return Builder->CreateFCmpULT(L, R, "cmptmp");
+    case '>':
+      return Builder->CreateFCmpUGT(L, R, "cmptmp");
+    case tok_le:
+      return Builder->CreateFCmpULE(L, R, "cmptmp");
+    case tok_ge:
+      return Builder->CreateFCmpUGE(L, R, "cmptmp");
+    case tok_eq:
+      return Builder->CreateFCmpOEQ(L, R, "cmptmp");
+    default:
+      return Builder->CreateFCmpUNE(L, R, "cmptmp");
   }
+}
 
-  Function *F = getFunction(std::string("unary") + a->op);
-  if (!F) {
-    return logErrorV("Unknown unary operator");
+// The value of && or || where it is used as a number: 1 or 0.
+Value *GenerateCode::emitLogicalValue(BinaryExprAST *a) {
+  Function *theFunction = Builder->GetInsertBlock()->getParent();
+
+  BasicBlock *trueBB = BasicBlock::Create(*theContext, "logic.true");
+  BasicBlock *falseBB = BasicBlock::Create(*theContext, "logic.false");
+  BasicBlock *mergeBB = BasicBlock::Create(*theContext, "logic.end");
+
+  if (!emitBranch(a, trueBB, falseBB)) {
+    adoptBlocks(theFunction, {trueBB, falseBB, mergeBB});
+    return nullptr;
   }
 
-  if (printDebug) debugInfo.emitLocation(a);
-  return Builder->CreateCall(F, operandV, "unop");
+  theFunction->getBasicBlockList().push_back(trueBB);
+  Builder->SetInsertPoint(trueBB);
+  Builder->CreateBr(mergeBB);
+
+  theFunction->getBasicBlockList().push_back(falseBB);
+  Builder->SetInsertPoint(falseBB);
+  Builder->CreateBr(mergeBB);
+
+  theFunction->getBasicBlockList().push_back(mergeBB);
+  Builder->SetInsertPoint(mergeBB);
+
+  PHINode *PN = Builder->CreatePHI(Type::getDoubleTy(*theContext), 2,
+                                   "logictmp");
+  PN->addIncoming(ConstantFP::get(*theContext, APFloat(1.0)), trueBB);
+  PN->addIncoming(ConstantFP::get(*theContext, APFloat(0.0)), falseBB);
+
+  return PN;
 }
 
-Value *GenerateCode::codegen(CallExprAST *a) {
-  if (printDebug) debugInfo.emitLocation(a);
+// Blocks are created detached and inserted once the code leading to them is
+// lowered. When lowering fails first, the function takes whichever are
+// still detached, so they are freed with it when the definition is erased.
+void GenerateCode::adoptBlocks(Function *theFunction,
+                               ArrayRef<BasicBlock *> blocks) {
+  for (BasicBlock *BB : blocks) {
+    if (!BB->getParent()) {
+      theFunction->getBasicBlockList().push_back(BB);
+    }
+  }
+}
+
+// Branches on a condition without turning it into a double and back.
+// Comparisons feed the branch directly, && and || short-circuit through
+// blocks of their own, and ':' lowers its left side before testing its
+// right. Anything else holds when it is not zero.
+bool GenerateCode::emitBranch(ExprAST *cond, BasicBlock *trueBB,
+                              BasicBlock *falseBB) {
+  Function *theFunction = Builder->GetInsertBlock()->getParent();
+
+  while (auto *a = dyn_cast<BinaryExprAST>(cond)) {
+    if (a->op == ':') {
+      if (!codegen(a->LHS)) {
+        return false;
+      }
+      cond = a->RHS;
+      continue;
+    }
 
-  Function *calleeF = getFunction(a->callee);
-  // Function *calleeF = theModule->getFunction(a->callee);
-  if (!calleeF) {
-    return logErrorV("Unknown function referenced");
+    if (isComparison(a->op)) {
+      if (options.printDebug) emitLocation(a);
+      Value *L = codegen(a->LHS);
+      if (!L) {
+        return false;
+      }
+      Value *R = codegen(a->RHS);
+      if (!R) {
+        return false;
+      }
+      Builder->CreateCondBr(emitComparison(a->op, L, R), trueBB, falseBB);
+      return true;
+    }
+
+    if (!isLogical(a->op)) {
+      break;
+    }
+
+    // A chain of one operator, (x && y) && z, is taken apart here rather
+    // than recursively, so only alternating && and || nest.
+    SmallVector<ExprAST *, 4> terms;
+    ExprAST *first = a;
+    for (auto *b = a; b && b->op == a->op;
+         b = dyn_cast<BinaryExprAST>(first)) {
+      terms.push_back(b->RHS);
+      first = b->LHS;
+    }
+    terms.push_back(first);
+    std::reverse(terms.begin(), terms.end());
+
+    // Each term but the last decides the outcome on its own if it fails
+    // an && or holds for an ||; otherwise the next term is tested.
+    bool isAnd = a->op == tok_and;
+    for (ExprAST *term : makeArrayRef(terms).drop_back()) {
+      BasicBlock *nextBB =
+          BasicBlock::Create(*theContext, isAnd ? "and.rhs" : "or.rhs");
+      if (!emitBranch(term, isAnd ? nextBB : trueBB,
+                      isAnd ? falseBB : nextBB)) {
+        adoptBlocks(theFunction, nextBB);
+        return false;
+      }
+      theFunction->getBasicBlockList().push_back(nextBB);
+      Builder->SetInsertPoint(nextBB);
+    }
+    cond = terms.back();
   }
 
-  if (calleeF->arg_size() != a->args.size()) {
-    return logErrorV("Incorrect number of arguments passed");
+  Value *condV = codegen(cond);
+  if (!condV) {
+    return false;
   }
+  condV = Builder->CreateFCmpONE(
+      condV, ConstantFP::get(*theContext, APFloat(0.0)), "cond");
+  Builder->CreateCondBr(condV, trueBB, falseBB);
+  return true;
+}
 
-  std::vector<Value *> argsV;
-  for (unsigned i = 0, e = a->args.size(); i != e; i++) {
-    argsV.push_back(a->args[i]->codegen(this));
-    if (!argsV.back()) {
-      return nullptr;
+Value *GenerateCode::emitUnaryOp(UnaryExprAST *a, Value *operandV) {
+  OperatorInfo &info = operators[a->op];
+  Function *F = info.unaryFn;
+  if (!F) {
+    if (info.unaryName != noOperatorFn) {
+      F = info.unaryFn = getFunction(info.unaryName);
+    }
+    if (!F) {
+      return logErrorV("Unknown unary operator");
     }
   }
 
-  return Builder->CreateCall(calleeF, argsV, "calltmp");
+  if (options.printDebug) emitLocation(a);
+  return Builder->CreateCall(F, operandV, "unop");
 }
 
-Value *GenerateCode::codegen(IfExprAST *a) {
-  if (printDebug) debugInfo.emitLocation(a);
-
-  Value *condV = a->cond->codegen(this);
-  if (!condV) {
-    return nullptr;
+void GenerateCode::emitTierCount() {
+  if (tierCounterId < 0) {
+    return;
   }
 
-  condV = Builder->CreateFCmpONE(
-      condV, ConstantFP::get(*theContext, APFloat(0.0)), "ifcond");
+  FunctionCallee hook = theModule->getOrInsertFunction(
+      tierCountHook, Type::getVoidTy(*theContext),
+      Type::getInt32Ty(*theContext));
+  Builder->CreateCall(hook, Builder->getInt32(tierCounterId));
+}
+
+Value *GenerateCode::codegen(IfExprAST *a) {
+  if (options.printDebug) emitLocation(a);
 
   Function *theFunction = Builder->GetInsertBlock()->getParent();
 
-  BasicBlock *thenBB = BasicBlock::Create(*theContext, "then", theFunction);
+  BasicBlock *thenBB = BasicBlock::Create(*theContext, "then");
   BasicBlock *elseBB = BasicBlock::Create(*theContext, "else");
   BasicBlock *mergeBB = BasicBlock::Create(*theContext, "ifcont");
 
-  Builder->CreateCondBr(condV, thenBB, elseBB);
+  if (!emitBranch(a->cond, thenBB, elseBB)) {
+    adoptBlocks(theFunction, {thenBB, elseBB, mergeBB});
+    return nullptr;
+  }
 
+  theFunction->getBasicBlockList().push_back(thenBB);
   Builder->SetInsertPoint(thenBB);
 
-  Value *thenV = a->then->codegen(this);
+  Value *thenV = codegen(a->then);
   if (!thenV) {
+    adoptBlocks(theFunction, {elseBB, mergeBB});
     return nullptr;
   }
 
@@ -708,8 +1155,9 @@ Value *GenerateCode::codegen(IfExprAST *a) {
   theFunction->getBasicBlockList().push_back(elseBB);
   Builder->SetInsertPoint(elseBB);
 
-  Value *elseV = a->_else->codegen(this);
+  Value *elseV = codegen(a->_else);
   if (!elseV) {
+    adoptBlocks(theFunction, mergeBB);
     return nullptr;
   }
 
@@ -728,55 +1176,131 @@ Value *GenerateCode::codegen(IfExprAST *a) {
   return PN;
 }
 
+// The llvm.loop node for a hinted loop, with the properties clang emits for
+// the matching #pragma clang loop, plus where the loop starts.
+MDNode *GenerateCode::createLoopID(ForExprAST &a) {
+  auto property = [&](StringRef name, Type *type,
+                      uint64_t value) -> Metadata * {
+    return MDNode::get(*theContext,
+                       {MDString::get(*theContext, name),
+                        ConstantAsMetadata::get(ConstantInt::get(type, value))});
+  };
+  Type *i1 = Type::getInt1Ty(*theContext);
+  Type *i32 = Type::getInt32Ty(*theContext);
+
+  // The first operand becomes the node itself.
+  SmallVector<Metadata *, 6> ops = {nullptr};
+  ops.push_back(MDNode::get(
+      *theContext,
+      {MDString::get(*theContext, loopLocationTag),
+       ConstantAsMetadata::get(ConstantInt::get(i32, a.getLine())),
+       ConstantAsMetadata::get(ConstantInt::get(i32, a.getCol()))}));
+
+  const LoopHints &hints = a.hints;
+  if (hints.unrollCount == 1) {
+    ops.push_back(MDNode::get(
+        *theContext, MDString::get(*theContext, "llvm.loop.unroll.disable")));
+  } else if (hints.unrollCount) {
+    ops.push_back(property("llvm.loop.unroll.count", i32, hints.unrollCount));
+  }
+  if (hints.vectorizeWidth) {
+    ops.push_back(
+        property("llvm.loop.vectorize.width", i32, hints.vectorizeWidth));
+    ops.push_back(property("llvm.loop.vectorize.enable", i1, 1));
+  }
+  if (hints.interleaveCount) {
+    ops.push_back(
+        property("llvm.loop.interleave.count", i32, hints.interleaveCount));
+  }
+  if (hints.noVectorize) {
+    ops.push_back(property("llvm.loop.vectorize.enable", i1, 0));
+  }
+
+  // Only the whole-module pipeline runs the unroller and the vectoriser
+  // the hints are for; say so rather than drop them without a word.
+  if (options.runJIT || !options.wholeModulePipeline ||
+      options.optLevel == OptimizationLevel::O0) {
+    errs() << theModule->getSourceFileName() + ":" +
+                  std::to_string(a.getLine()) + ":" +
+                  std::to_string(a.getCol()) +
+                  ": warning: loop hints ignored; the loop optimisers only "
+                  "run on object builds at -O1 and above without "
+                  "-Ofast-compile\n";
+  }
+
+  MDNode *loopID = MDNode::getDistinct(*theContext, ops);
+  loopID->replaceOperandWith(0, loopID);
+  return loopID;
+}
+
+// Lowers a loop. When optimising, the loop is rotated: the condition is
+// tested once in front of the loop and again at its bottom, so the loop is
+// entered through a dedicated preheader and left only from its latch, the
+// shape LLVM's loop passes expect. At -O0 nothing would fold the second
+// copy of the condition, so the loop keeps a single test at its header.
+// The loop variable lives in an alloca like every other variable; mem2reg
+// turns it into the induction PHI.
 Value *GenerateCode::codegen(ForExprAST *a) {
   Function *theFunction = Builder->GetInsertBlock()->getParent();
-  BasicBlock *preHeaderBB = Builder->GetInsertBlock();
 
-  AllocaInst *alloca = createEntryBlockAlloca(theFunction, a->varName);
+  AllocaInst *alloca =
+      createEntryBlockAlloca(theFunction, symbols.str(a->varName));
 
-  if (printDebug) debugInfo.emitLocation(a);
+  if (options.printDebug) emitLocation(a);
 
-  Value *startVal = a->start->codegen(this);
+  Value *startVal = codegen(a->start);
   if (!startVal) {
     return nullptr;
   }
 
   Builder->CreateStore(startVal, alloca);
 
-  AllocaInst *oldVal = namedValues[a->varName];
-  namedValues[a->varName] = alloca;
+  namedValues.push();
+  namedValues.bind(a->varName, alloca);
 
-  BasicBlock *startCondition =
-      BasicBlock::Create(*theContext, "startcond", theFunction);
-  Builder->CreateBr(startCondition);
+  bool rotate = options.optLevel != OptimizationLevel::O0;
 
-  Builder->SetInsertPoint(startCondition);
+  // Rotated, the guard enters the loop through the preheader; otherwise
+  // the header holds the only test.
+  BasicBlock *entryBB =
+      BasicBlock::Create(*theContext, rotate ? "preheader" : "loopcond");
+  BasicBlock *loopBB = BasicBlock::Create(*theContext, "loop");
+  BasicBlock *afterBB = BasicBlock::Create(*theContext, "afterloop");
 
-  Value *startCond = a->cond->codegen(this);
-  if (!startCond) {
-    return nullptr;
+  // The block the loop header is entered from, as opposed to its latches.
+  BasicBlock *enteringBB = entryBB;
+  if (rotate) {
+    if (!emitBranch(a->cond, entryBB, afterBB)) {
+      adoptBlocks(theFunction, {entryBB, loopBB, afterBB});
+      return nullptr;
+    }
+  } else {
+    enteringBB = Builder->GetInsertBlock();
+    Builder->CreateBr(entryBB);
   }
-  startCond = Builder->CreateFCmpONE(
-      startCond, ConstantFP::get(*theContext, APFloat(0.0)), "startcond");
 
-  BasicBlock *loopBB = BasicBlock::Create(*theContext, "loop", theFunction);
+  theFunction->getBasicBlockList().push_back(entryBB);
+  Builder->SetInsertPoint(entryBB);
+  if (rotate) {
+    Builder->CreateBr(loopBB);
+  } else if (!emitBranch(a->cond, loopBB, afterBB)) {
+    adoptBlocks(theFunction, {entryBB, loopBB, afterBB});
+    return nullptr;
+  }
 
-  // Builder->CreateBr(loopBB);
+  theFunction->getBasicBlockList().push_back(loopBB);
   Builder->SetInsertPoint(loopBB);
 
-  // PHINode *variable = Builder->CreatePHI(Type::getDoubleTy(*theContext), 2,
-  // a->varName.c_str());
-
-  // variable->addIncoming(startVal, preHeaderBB);
-
-  if (!a->body->codegen(this)) {
+  if (!codegen(a->body)) {
+    adoptBlocks(theFunction, {entryBB, loopBB, afterBB});
     return nullptr;
   }
 
   Value *stepVal = nullptr;
   if (a->step) {
-    stepVal = a->step->codegen(this);
+    stepVal = codegen(a->step);
     if (!stepVal) {
+      adoptBlocks(theFunction, {entryBB, loopBB, afterBB});
       return nullptr;
     }
   } else {
@@ -784,83 +1308,102 @@ Value *GenerateCode::codegen(ForExprAST *a) {
   }
 
   Value *curVar = Builder->CreateLoad(alloca->getAllocatedType(), alloca,
-                                      a->varName.c_str());
+                                      symbols.str(a->varName));
   Value *nextVar = Builder->CreateFAdd(curVar, stepVal, "nextvar");
 
   Builder->CreateStore(nextVar, alloca);
-  BasicBlock *loopEndBB = Builder->GetInsertBlock();
-  Builder->CreateBr(startCondition);
+  emitTierCount();
 
-  BasicBlock *afterBB =
-      BasicBlock::Create(*theContext, "afterloop", theFunction);
+  BasicBlock *headerBB = loopBB;
+  if (rotate) {
+    if (!emitBranch(a->cond, loopBB, afterBB)) {
+      adoptBlocks(theFunction, {entryBB, loopBB, afterBB});
+      return nullptr;
+    }
+  } else {
+    headerBB = entryBB;
+    Builder->CreateBr(entryBB);
+  }
+
+  // With || in a rotated condition, more than one branch may lead back.
+  if (!a->hints.empty()) {
+    MDNode *loopID = createLoopID(*a);
+    for (BasicBlock *pred : predecessors(headerBB)) {
+      if (pred != enteringBB) {
+        pred->getTerminator()->setMetadata(LLVMContext::MD_loop, loopID);
+      }
+    }
+  }
 
-  Builder->SetInsertPoint(startCondition);
-  Builder->CreateCondBr(startCond, loopBB, afterBB);
+  theFunction->getBasicBlockList().push_back(afterBB);
   Builder->SetInsertPoint(afterBB);
 
-  if (oldVal) {
-    namedValues[a->varName] = oldVal;
-  } else {
-    namedValues.erase(a->varName);
-  }
+  namedValues.pop();
 
   return Constant::getNullValue(Type::getDoubleTy(*theContext));
 }
 
+// Nested var blocks are lowered in one loop, a scope per level, so a deep
+// chain does not cost a native stack frame per level.
 Value *GenerateCode::codegen(VarExprAST *a) {
-  std::map<std::string, AllocaInst *> oldNamedValues(namedValues);
-
   Function *theFunction = Builder->GetInsertBlock()->getParent();
 
-  for (unsigned i = 0, e = (a->vars).size(); i != e; ++i) {
-    std::string varName = (a->vars[i]).first;
-    auto init = std::move((a->vars[i]).second);
-    Value *initVal;
-
-    if (init) {
-      initVal = init->codegen(this);
-      if (!initVal) {
-        return nullptr;
+  unsigned depth = 0;
+  ExprAST *body = a;
+  while (auto *level = dyn_cast<VarExprAST>(body)) {
+    namedValues.push();
+    depth++;
+
+    for (unsigned i = 0, e = (level->vars).size(); i != e; ++i) {
+      Symbol varName = (level->vars[i]).name;
+      ExprAST *init = (level->vars[i]).init;
+      Value *initVal;
+
+      if (init) {
+        initVal = codegen(init);
+        if (!initVal) {
+          return nullptr;
+        }
+      } else {
+        initVal = ConstantFP::get(*theContext, APFloat(0.0));
       }
-    } else {
-      initVal = ConstantFP::get(*theContext, APFloat(0.0));
-    }
 
-    AllocaInst *alloca = createEntryBlockAlloca(theFunction, varName);
-    Builder->CreateStore(initVal, alloca);
+      AllocaInst *alloca =
+          createEntryBlockAlloca(theFunction, symbols.str(varName));
+      Builder->CreateStore(initVal, alloca);
 
-    namedValues[varName] = alloca;
+      namedValues.bind(varName, alloca);
+    }
 
-    init.release();
+    if (options.printDebug) emitLocation(level);
+    body = level->body;
   }
 
-  if (printDebug) debugInfo.emitLocation(a);
-
-  Value *bodyVal = a->body->codegen(this);
+  Value *bodyVal = codegen(body);
   if (!bodyVal) {
     return nullptr;
   }
 
-  namedValues = oldNamedValues;
+  while (depth--) {
+    namedValues.pop();
+  }
 
   return bodyVal;
 }
 
 Function *GenerateCode::Codegen(PrototypeAST *a) {
-  std::vector<Type *> doubles(a->args.size(), Type::getDoubleTy(*theContext));
+  std::vector<Type *> doubles(a->argNames.size(),
+                              Type::getDoubleTy(*theContext));
 
   FunctionType *FT =
       FunctionType::get(Type::getDoubleTy(*theContext), doubles, false);
 
-  Function *F =
-      Function::Create(FT, Function::ExternalLinkage, a->name, theModule.get());
+  Function *F = Function::Create(FT, Function::ExternalLinkage, a->getName(),
+                                 theModule.get());
 
   unsigned idx = 0;
   for (auto &arg : F->args()) {
-    // Setting name of arguments to make IR more readable - may need to change
-    // the PrototypeAST (change std::unique_ptr<ExprAST> to std::string - but
-    // might break something else :((())))
-    arg.setName(a->argString[idx++]);
+    arg.setName(symbols.str(a->argNames[idx++]));
   }
 
   return F;
@@ -868,8 +1411,7 @@ Function *GenerateCode::Codegen(PrototypeAST *a) {
 
 Function *GenerateCode::Codegen(FunctionAST *a) {
   auto &p = *(a->proto);
-  functionProtos[a->proto->getName()] = std::move(a->proto);
-  Function *theFunction = getFunction(p.getName());
+  Function *theFunction = getFunction(p.name);
 
   // Function *theFunction = theModule->getFunction(a->proto->getName());
 
@@ -883,7 +1425,9 @@ Function *GenerateCode::Codegen(FunctionAST *a) {
   }
 
   if (p.isBinaryOp()) {
-    binOpPrecedence[p.getName()[p.name.size() - 1]] = p.precedence;
+    operators[p.getOperatorName()].binaryFn = theFunction;
+  } else if (p.isUnaryOp()) {
+    operators[p.getOperatorName()].unaryFn = theFunction;
   }
 
   // if(!theFunction->empty())
@@ -894,7 +1438,19 @@ Function *GenerateCode::Codegen(FunctionAST *a) {
   BasicBlock *BB = BasicBlock::Create(*theContext, "entry:", theFunction);
   Builder->SetInsertPoint(BB);
 
-  if (printDebug) {
+  // Every floating-point instruction the builder creates for the body,
+  // calls to user-defined operators included, carries these flags.
+  FastMathFlags FMF;
+  if (options.fastMath || p.fastMath) {
+    FMF.setAllowReassoc();
+    FMF.setNoNaNs();
+    FMF.setNoInfs();
+    FMF.setAllowContract();
+    FMF.setApproxFunc();
+  }
+  Builder->setFastMathFlags(FMF);
+
+  if (options.printDebug) {
     DIFile *unit = DBuilder->createFile(debugInfo.theCU->getFilename(),
                                         debugInfo.theCU->getDirectory());
     DIScope *fContext = unit;
@@ -910,16 +1466,15 @@ Function *GenerateCode::Codegen(FunctionAST *a) {
     theFunction->setSubprogram(SP);
 
     debugInfo.lexicalBlocks.push_back(SP);
-    debugInfo.emitLocation(nullptr);
+    emitLocation(nullptr);
     namedValues.clear();
     unsigned argidx = 0;
     for (auto &arg : theFunction->args()) {
-      AllocaInst *alloca =
-          createEntryBlockAlloca(theFunction, arg.getName().str());
+      AllocaInst *alloca = createEntryBlockAlloca(theFunction, arg.getName());
 
-      if (printDebug) {
+      if (options.printDebug) {
         DILocalVariable *D = DBuilder->createParameterVariable(
-            SP, arg.getName(), ++argidx, unit, lineNo, debugInfo.getDoubleTy(),
+            SP, arg.getName(), ++argidx, unit, lineNo, getDebugDoubleTy(),
             true);
 
         DBuilder->insertDeclare(
@@ -929,27 +1484,35 @@ Function *GenerateCode::Codegen(FunctionAST *a) {
       }
 
       Builder->CreateStore(&arg, alloca);
-      namedValues[arg.getName().str()] = alloca;
-      debugInfo.emitLocation(a->body.get());
+      namedValues.bind(p.argNames[argidx - 1], alloca);
+      emitLocation(a->body);
     }
   } else {
     namedValues.clear();
+    unsigned argidx = 0;
     for (auto &arg : theFunction->args()) {
-      AllocaInst *alloca =
-          createEntryBlockAlloca(theFunction, arg.getName().str());
+      AllocaInst *alloca = createEntryBlockAlloca(theFunction, arg.getName());
       Builder->CreateStore(&arg, alloca);
-      namedValues[arg.getName().str()] = alloca;
+      namedValues.bind(p.argNames[argidx++], alloca);
     }
   }
 
-  if (Value *retVal = a->body->codegen(this)) {
+  emitTierCount();
+
+  if (Value *retVal = codegen(a->body)) {
     Builder->CreateRet(retVal);
 
     debugInfo.lexicalBlocks.pop_back();
 
     verifyFunction(*theFunction);
 
-    if (!enableDebug) theFPM->run(*theFunction);
+    // Each definition is simplified as it is lowered, which keeps the
+    // module small for the whole-module pipeline that object builds run at
+    // the end. With -t, definitions start unoptimised and the background
+    // tier-up runs these passes on the ones that turn out to be hot.
+    if (!options.tierThreshold) {
+      optimiser->runOnFunction(*theFunction);
+    }
 
     return theFunction;
   }
@@ -957,10 +1520,12 @@ Function *GenerateCode::Codegen(FunctionAST *a) {
   theFunction->eraseFromParent();
 
   if (p.isBinaryOp()) {
-    binOpPrecedence.erase(a->proto->getOperatorName());
+    operators[p.getOperatorName()].binaryFn = nullptr;
+  } else if (p.isUnaryOp()) {
+    operators[p.getOperatorName()].unaryFn = nullptr;
   }
 
-  if (printDebug) debugInfo.lexicalBlocks.pop_back();
+  if (options.printDebug) debugInfo.lexicalBlocks.pop_back();
 
   return nullptr;
 }
@@ -974,7 +1539,9 @@ Function *GenerateCode::Codegen(FunctionAST *a) {
 
 // gotta change initialize() function
 
-void compileToObject() {
+// A target machine for object files at the session's optimisation level.
+// Safe to call from any thread.
+std::unique_ptr<TargetMachine> CompilerSession::createTargetMachine() {
   /*InitializeAllTargetInfos();
 InitializeAllTargets();
 InitializeAllTargetMCs();
@@ -989,125 +1556,509 @@ InitializeAllAsmPrinters();*/
 
   if (!Target) {
     errs() << Error;
-    return;
+    return nullptr;
   }
 
-  auto CPU = "generic";
-  auto Features = "";
+  std::string CPU = options.cpu;
+  std::string Features = options.features;
+  if (CPU == "native") {
+    CPU = sys::getHostCPUName().str();
+    StringMap<bool> hostFeatures;
+    if (sys::getHostCPUFeatures(hostFeatures)) {
+      SubtargetFeatures attrs;
+      for (auto &feature : hostFeatures) {
+        attrs.AddFeature(feature.first(), feature.second);
+      }
+      // Explicit -mattr features come last, so they win.
+      if (!Features.empty()) attrs.AddFeature(Features);
+      Features = attrs.getString();
+    }
+  }
+
+  std::unique_ptr<MCSubtargetInfo> subtarget(
+      Target->createMCSubtargetInfo(TargetTriple, "", ""));
+  if (!subtarget->isCPUStringValid(CPU)) {
+    errs() << "Unknown CPU " << CPU << " for " << TargetTriple << "\n";
+    return nullptr;
+  }
 
   TargetOptions opt;
   auto RM = Optional<Reloc::Model>();
-  auto theTargetMachine =
-      Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
+  // Resolvers hand out function addresses, which have to work in PIEs.
+  if (!options.isaLevels.empty()) RM = Reloc::PIC_;
+  return std::unique_ptr<TargetMachine>(Target->createTargetMachine(
+      TargetTriple, CPU, Features, opt, RM, None,
+      getCodeGenOptLevel(options.optLevel)));
+}
+
+TargetMachine *CompilerSession::getObjectTargetMachine() {
+  if (!objectTargetMachine) {
+    objectTargetMachine = createTargetMachine();
+  }
 
   // theModule->setDataLayout(theTargetMachine->createDataLayout());
 
-  auto Filename = outFileName;
-  std::error_code EC;
-  raw_fd_ostream dest(Filename, EC, sys::fs::OF_None);
+  return objectTargetMachine.get();
+}
 
-  if (EC) {
-    errs() << "Could not open file: " << EC.message();
+// Runs the whole-module pipeline, tuned for the object target, unless
+// -Ofast-compile turned it off. Hot functions are multiversioned first, so that each
+// clone is optimised for its own ISA level; without the pipeline the clones
+// only differ in instruction selection.
+void CompilerSession::optimiseModule(Module &M) {
+  if (!options.isaLevels.empty()) {
+    TargetMachine *TM = getObjectTargetMachine();
+    if (TM && TM->getTargetTriple().getArch() == Triple::x86_64 &&
+        TM->getTargetTriple().isOSBinFormatELF()) {
+      multiversionFunctions(M, options.isaLevels);
+    } else {
+      fprintf(stderr, "LogError: -mversions needs an x86-64 ELF target\n");
+    }
+  }
+
+  if (!options.wholeModulePipeline) {
     return;
   }
 
+  if (!moduleOptimiser) {
+    moduleOptimiser =
+        std::make_unique<Optimiser>(options.optLevel, getObjectTargetMachine(),
+                                    options.remarks);
+  }
+  moduleOptimiser->runOnModule(M);
+}
+
+bool CompilerSession::emitObject(Module &M, raw_pwrite_stream &dest) {
+  auto theTargetMachine = getObjectTargetMachine();
+  if (!theTargetMachine) {
+    return false;
+  }
+
   legacy::PassManager pass;
   auto Filetype = CGFT_ObjectFile;
 
   if (theTargetMachine->addPassesToEmitFile(pass, dest, nullptr, Filetype)) {
     errs() << "TargetMachine cannot emit a file of this type";
+    return false;
+  }
+
+  pass.run(M);
+  return true;
+}
+
+extern std::string hashDefinition(FunctionAST &fn, StringRef salt,
+                                  const SymbolTable &symbols,
+                                  const PrototypeMap &functionProtos);
+
+void CompilerSession::initialiseIncremental() {
+  auto theTargetMachine = getObjectTargetMachine();
+  if (!theTargetMachine) {
     return;
   }
 
-  pass.run(*theModule);
-  dest.flush();
+  aotSalt = theTargetMachine->getTargetTriple().str() + "|" +
+            theTargetMachine->getTargetCPU().str() + "|" +
+            theTargetMachine->getTargetFeatureString().str() + "|" +
+            getOptLevelName(options.optLevel);
+  if (!options.wholeModulePipeline) aotSalt += "|function";
+  if (options.fastMath) aotSalt += "|fast";
+  for (unsigned level : options.isaLevels) {
+    aotSalt += "|v" + std::to_string(level);
+  }
+  aotCache = std::make_unique<DiskObjectCache>(
+      options.cacheDir, aotSalt, options.cacheLimitMB << 20);
+}
+
+// Makes a prototype visible to the code that follows it. Definitions keep
+// their own prototype, so the table holds a copy.
+void CompilerSession::registerPrototype(const PrototypeAST &p) {
+  if (p.isBinaryOp()) {
+    operators.nameBinary(p.getOperatorName(), p.name);
+  } else if (p.isUnaryOp()) {
+    operators.nameUnary(p.getOperatorName(), p.name);
+  }
 
-  outs() << "Wrote " << Filename << "\n";
+  auto entry = std::make_unique<PrototypeAST>(p);
+  entry->order = registeredProtos++;
+  functionProtos[p.name] = std::move(entry);
 }
 
-void initializeDwarf() {
-  theModule->addModuleFlag(Module::Warning, "Debug Info Version",
-                           DEBUG_METADATA_VERSION);
+// Takes fn's object from the cache, or lowers it into a module of its own,
+// emits that and stores it. Returns false if fn fails to lower.
+bool CompilerSession::compileIncremental(FunctionAST &fn) {
+  std::string key = hashDefinition(fn, aotSalt, symbols, functionProtos);
+  registerPrototype(*fn.proto);
+  if (auto obj = aotCache->lookup(key)) {
+    aotObjects.push_back(std::move(obj));
+    return true;
+  }
 
-  if (Triple(sys::getProcessTriple()).isOSDarwin()) {
-    theModule->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 2);
+  if (!fn.Codegen(&codeGenerator)) {
+    return false;
   }
-  DBuilder = std::make_unique<DIBuilder>(*theModule);
 
-  debugInfo.theCU = DBuilder->createCompileUnit(
-      dwarf::DW_LANG_C, DBuilder->createFile(&fileName[0], "."),
-      "SimpleLang Compiler", !enableDebug, "", 0);
+  Module &M = *codeGenerator.theModule;
+  optimiseModule(M);
+  SmallVector<char, 0> buffer;
+  raw_svector_ostream dest(buffer);
+  if (!emitObject(M, dest)) {
+    return false;
+  }
+
+  auto obj = MemoryBuffer::getMemBufferCopy(
+      StringRef(buffer.data(), buffer.size()), key + ".o");
+  aotCache->store(key, obj->getMemBufferRef());
+  aotObjects.push_back(std::move(obj));
+
+  if (options.printIR) M.print(errs(), nullptr);
+  codeGenerator.startModule(theJIT->getDataLayout());
+  return true;
 }
 
-void initialiseModule() {
-  InitializeNativeTarget();
-  InitializeNativeTargetAsmPrinter();
-  InitializeNativeTargetAsmParser();
+// Sessions compiling other files of the same build may be reporting too.
+static void reportWritten(StringRef fileName) {
+  static std::mutex outputLock;
+  std::lock_guard<std::mutex> guard(outputLock);
+  outs() << "Wrote " << fileName << "\n";
+  outs().flush();
+}
 
-  theJIT = exitOnErr(llvm::orc::SimpleJIT::create());
+// Writes objects as one archive in place of the output object.
+void CompilerSession::writeObjectArchive(
+    const std::vector<std::unique_ptr<MemoryBuffer>> &objects) {
+  std::string archiveName = options.outFileName;
+  if (StringRef(archiveName).endswith(".o")) {
+    archiveName.back() = 'a';
+  }
 
-  theContext = std::make_unique<LLVMContext>();
-  theModule = std::make_unique<Module>("FirstLang", *theContext);
-  theModule->setDataLayout(theJIT->getDataLayout());
-  Builder = std::make_unique<IRBuilder<>>(*theContext);
+  // Members are named after the object alone, so cached and freshly built
+  // objects give the same archive.
+  std::vector<NewArchiveMember> members;
+  for (auto &obj : objects) {
+    members.emplace_back(obj->getMemBufferRef());
+    members.back().MemberName =
+        sys::path::filename(obj->getBufferIdentifier());
+  }
+
+  if (auto err = writeArchive(archiveName, members, true,
+                              object::Archive::K_GNU, true, false)) {
+    logAllUnhandledErrors(std::move(err), errs(), "LogError: ");
+    return;
+  }
+
+  reportWritten(archiveName);
+  writtenFile = archiveName;
+}
+
+void CompilerSession::compileToObject() {
+  if (aotCache) {
+    writeObjectArchive(aotObjects);
+    return;
+  }
+  if (options.splitParts > 1) {
+    emitSplitObjects();
+    return;
+  }
+  if (!getObjectTargetMachine()) {
+    return;
+  }
+
+  auto Filename = options.outFileName;
+  std::error_code EC;
+  raw_fd_ostream dest(Filename, EC, sys::fs::OF_None);
+
+  if (EC) {
+    errs() << "Could not open file: " << EC.message();
+    return;
+  }
+
+  if (!emitObject(*codeGenerator.theModule, dest)) {
+    return;
+  }
+  dest.flush();
+
+  reportWritten(Filename);
+  writtenFile = Filename;
+}
 
-  theFPM = std::make_unique<legacy::FunctionPassManager>(theModule.get());
+void CompilerSession::initialiseModule() {
+  // Target registration is process-wide; sessions on other threads may be
+  // getting here at the same time.
+  static std::once_flag targetsInitialised;
+  std::call_once(targetsInitialised, []() {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+  });
+
+  // The JIT only compiles code in -run modes; otherwise it just supplies
+  // the data layout, and there is nothing to cache.
+  theJIT = exitOnErr(llvm::orc::SimpleJIT::create(
+      options.runJIT ? options.cacheDir : "", options.cacheLimitMB << 20));
+  if (options.runJIT) {
+    exitOnErr(theJIT->defineAbsolute("putchard",
+                                     pointerToJITTargetAddress(&putchard)));
+    exitOnErr(
+        theJIT->defineAbsolute("printd", pointerToJITTargetAddress(&printd)));
+    exitOnErr(
+        theJIT->defineAbsolute("clear", pointerToJITTargetAddress(&clear)));
+  }
+  if (options.lazyJIT) exitOnErr(theJIT->enableLazyCompilation());
+  if (options.tierThreshold) {
+    theTiers = exitOnErr(TierManager::create(*theJIT, options.tierThreshold,
+                                             options.optLevel, options.remarks));
+  }
+
+  // Debug info describes the whole file, so debug builds stay monolithic.
+  if (!options.runJIT && !options.cacheDir.empty() && !options.printDebug) {
+    initialiseIncremental();
+  }
+  parallelBuild = options.jobs > 1 && !options.runJIT && !options.printDebug &&
+                  !aotCache;
+
+  codeGenerator.startModule(theJIT->getDataLayout());
+}
 
-  theFPM->add(createInstructionCombiningPass());
-  theFPM->add(createReassociatePass());
-  theFPM->add(createGVNPass());
-  theFPM->add(createCFGSimplificationPass());
-  theFPM->add(createPromoteMemoryToRegisterPass());
-  theFPM->doInitialization();
+// Moves the module built so far into the JIT. Earlier definitions stay
+// callable from later modules through the JIT's symbol lookup. Modules
+// without a tracker hold definitions, which -lazy compiles on first call.
+void CompilerSession::addModuleToJIT(orc::ResourceTrackerSP RT) {
+  if (options.printIR) codeGenerator.theModule->print(errs(), nullptr);
+
+  orc::ThreadSafeModule TSM(std::move(codeGenerator.theModule),
+                            std::move(codeGenerator.theContext));
+  if (RT && theTiers) {
+    exitOnErr(theJIT->addBaselineModule(std::move(TSM), std::move(RT)));
+  } else if (RT) {
+    exitOnErr(theJIT->addModule(std::move(TSM), std::move(RT)));
+  } else {
+    exitOnErr(theJIT->addLazyModule(std::move(TSM)));
+  }
+  codeGenerator.startModule(theJIT->getDataLayout());
 }
 
-bool genDefinition() {
+// Compiles the pending top-level expression on its own, calls it and frees
+// its code again.
+void CompilerSession::runTopLvlExpr() {
+  auto RT = theJIT->getMainJITDylib().createResourceTracker();
+  addModuleToJIT(RT);
+
+  // A call to a definition that failed to compile leaves an unresolved
+  // symbol; report it and carry on with the rest of the script.
+  if (auto exprSymbol = theJIT->lookup("main")) {
+    auto *FP = (double (*)())(intptr_t)exprSymbol->getAddress();
+    FP();
+  } else {
+    logAllUnhandledErrors(exprSymbol.takeError(), errs(), "LogError: ");
+  }
+
+  exitOnErr(RT->remove());
+}
+
+// Hands a lowered definition to the tier manager, which runs it as baseline
+// code behind a stub until it gets hot.
+void CompilerSession::addTieredDefinition(Function *F, unsigned tierId) {
+  if (options.printIR) codeGenerator.theModule->print(errs(), nullptr);
+
+  if (auto err = theTiers->addDefinition(std::move(codeGenerator.theModule),
+                                         std::move(codeGenerator.theContext),
+                                         F, tierId)) {
+    logAllUnhandledErrors(std::move(err), errs(), "LogError: ");
+  }
+  codeGenerator.startModule(theJIT->getDataLayout());
+}
+
+// Lowers a parsed item right away, or hands it to the back end when the
+// front end runs on a thread of its own. -fsyntax-only drops it.
+void CompilerSession::dispatch(ParsedItem item) {
+  if (options.syntaxOnly) {
+    return;
+  }
+  if (parsedItems) {
+    parsedItems->push(std::move(item));
+  } else {
+    lower(std::move(item));
+  }
+}
+
+void CompilerSession::lower(ParsedItem item) {
+  switch (item.kind) {
+    case ParsedItem::Definition:
+      lowerDefinition(std::move(item.fn));
+      break;
+    case ParsedItem::Extern:
+      lowerExtern(std::move(item.proto));
+      break;
+    case ParsedItem::TopLevel:
+      lowerTopLvlExpr(std::move(item.fn));
+      break;
+  }
+}
+
+bool CompilerSession::genDefinition() {
   if (auto fnAST = parseDefinition()) {
-    if (auto *fnIR = fnAST->Codegen(&codeGenerator)) {
-      // fprintf(stderr, "Read function definition:\n");
-      // fnIR->print(errs());
-      //  fnIR->viewCFG();
-      // fprintf(stderr, "\n");
-    } else {
-      fprintf(stderr, "Error reading function definition.");
-    }
+    dispatch({ParsedItem::Definition, std::move(fnAST), nullptr});
     return true;
   }
   return false;
 }
 
-bool genExtern() {
-  if (auto protoAST = parseExtern()) {
-    if (auto *fnIR = protoAST->Codegen(&codeGenerator)) {
-      // fprintf(stderr, "Read extern function:\n");
-      // fnIR->print(errs());
-      // fprintf(stderr, "\n");
-      functionProtos[protoAST->getName()] = std::move(protoAST);
+// Takes back the precedence parsing gave a binary operator whose definition
+// failed to lower, so the rest of the file no longer parses it as one. With
+// -pipeline the front end owns the precedences and may already have parsed
+// further uses; it takes the operator back before the next item it parses.
+void CompilerSession::rejectOperator(const PrototypeAST &p) {
+  if (p.precedenceHandle < 0) {
+    return;
+  }
+  if (parsedItems) {
+    std::lock_guard<std::mutex> lock(rejectedOperatorsMutex);
+    rejectedOperators.push_back(p.precedenceHandle);
+  } else {
+    operators.undefineBinary(p.precedenceHandle);
+  }
+}
+
+// Runs on the front end: applies what rejectOperator() queued.
+void CompilerSession::undoRejectedOperators() {
+  std::lock_guard<std::mutex> lock(rejectedOperatorsMutex);
+  for (int handle : rejectedOperators) {
+    operators.undefineBinary(handle);
+  }
+  rejectedOperators.clear();
+}
+
+void CompilerSession::lowerDefinition(std::unique_ptr<FunctionAST> fnAST) {
+  if (aotCache) {
+    if (compileIncremental(*fnAST)) {
+      definedFunctions.insert(fnAST->proto->name);
     } else {
-      fprintf(stderr, "Error reading extern.");
+      rejectOperator(*fnAST->proto);
+      fprintf(stderr, "Error reading function definition.");
     }
+    return;
+  }
+
+  if (parallelBuild) {
+    queueDefinition(std::move(fnAST), false);
+    return;
+  }
+
+  registerPrototype(*fnAST->proto);
+
+  int tierId = -1;
+  if (theTiers) {
+    tierId = theTiers->registerFunction(fnAST->proto->getName());
+  }
+
+  codeGenerator.setTierCounter(tierId);
+  Function *fnIR = fnAST->Codegen(&codeGenerator);
+  codeGenerator.setTierCounter(-1);
+
+  if (fnIR) {
+    definedFunctions.insert(fnAST->proto->name);
+    if (theTiers) {
+      addTieredDefinition(fnIR, tierId);
+    } else if (options.runJIT) {
+      std::string name = fnAST->proto->getName().str();
+      addModuleToJIT();
+      // Compiling each definition as it arrives keeps materialisation one
+      // level deep; left to the first call, a long chain of definitions
+      // would be compiled recursively and overflow the stack.
+      if (!theJIT->isLazy()) {
+        if (auto err = theJIT->lookup(name).takeError()) {
+          logAllUnhandledErrors(std::move(err), errs(), "LogError: ");
+        }
+      }
+    }
+    // fprintf(stderr, "Read function definition:\n");
+    // fnIR->print(errs());
+    //  fnIR->viewCFG();
+    // fprintf(stderr, "\n");
+  } else {
+    rejectOperator(*fnAST->proto);
+    fprintf(stderr, "Error reading function definition.");
+  }
+}
+
+bool CompilerSession::genExtern() {
+  if (auto protoAST = parseExtern()) {
+    dispatch({ParsedItem::Extern, nullptr, std::move(protoAST)});
     return true;
   }
 
   return false;
 }
 
-bool genTopLvlExpr() {
+void CompilerSession::lowerExtern(std::unique_ptr<PrototypeAST> protoAST) {
+  if (auto *fnIR = protoAST->Codegen(&codeGenerator)) {
+    // fprintf(stderr, "Read extern function:\n");
+    // fnIR->print(errs());
+    // fprintf(stderr, "\n");
+    registerPrototype(*protoAST);
+    declaredExterns.insert(protoAST->name);
+  } else {
+    fprintf(stderr, "Error reading extern.");
+  }
+}
+
+bool CompilerSession::genTopLvlExpr() {
   if (auto fnAST = parseTopLvlExpr()) {
-    if (auto *fnIR = fnAST->Codegen(&codeGenerator)) {
-      // fprintf(stderr, "Read top-level expression:\n");
-      // fnIR->print(errs());
-      // fprintf(stderr, "\n");
-    } else {
-      fprintf(stderr, "Error generating code for top level expression.");
-    }
+    dispatch({ParsedItem::TopLevel, std::move(fnAST), nullptr});
     return true;
   }
 
   return false;
 }
 
-void printALL() {
-  if (printDebug) DBuilder->finalize();
-  if (printIR) theModule->print(errs(), nullptr);
+void CompilerSession::lowerTopLvlExpr(std::unique_ptr<FunctionAST> fnAST) {
+  // A whole-file build keeps only the first top-level expression as main;
+  // incremental and parallel builds do the same.
+  if (aotCache) {
+    if (!haveMainObject) {
+      if (compileIncremental(*fnAST)) {
+        definedFunctions.insert(fnAST->proto->name);
+        haveMainObject = true;
+      } else {
+        fprintf(stderr, "Error generating code for top level expression.");
+      }
+    }
+    return;
+  }
+
+  if (parallelBuild) {
+    if (!haveMainObject) {
+      queueDefinition(std::move(fnAST), true);
+      haveMainObject = true;
+    }
+    return;
+  }
+
+  registerPrototype(*fnAST->proto);
+  if (auto *fnIR = fnAST->Codegen(&codeGenerator)) {
+    definedFunctions.insert(fnAST->proto->name);
+    if (options.runJIT) runTopLvlExpr();
+    // fprintf(stderr, "Read top-level expression:\n");
+    // fnIR->print(errs());
+    // fprintf(stderr, "\n");
+  } else {
+    fprintf(stderr, "Error generating code for top level expression.");
+  }
+}
+
+FileInterface CompilerSession::getInterface() const {
+  FileInterface interface;
+  for (auto &entry : functionProtos) {
+    const PrototypeAST &p = *entry.second;
+    if (definedFunctions.count(p.name)) {
+      interface.defined.push_back({p.getName().str(), p.argNames.size()});
+    } else if (declaredExterns.count(p.name)) {
+      interface.externs.push_back({p.getName().str(), p.argNames.size()});
+    }
+  }
+  return interface;
+}
+
+void CompilerSession::printALL() {
+  if (options.printIR) codeGenerator.theModule->print(errs(), nullptr);
 }
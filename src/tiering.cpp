@@ -0,0 +1,170 @@
+#include "../include/tiering.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+// The hook is a plain function address baked into baseline code, so it
+// finds its manager through this pointer. JIT code runs on the thread of the
+// session that owns the manager, so each thread has its own.
+static thread_local TierManager *activeTiers = nullptr;
+
+TierManager::TierManager(orc::SimpleJIT &JIT, uint64_t threshold,
+                         OptimizationLevel level, const RemarkFilter &remarks)
+    : JIT(JIT), threshold(threshold), optimiser(level, nullptr, remarks) {
+  activeTiers = this;
+  worker = std::thread([this]() { run(); });
+}
+
+TierManager::~TierManager() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_one();
+  worker.join();
+  activeTiers = nullptr;
+}
+
+Expected<std::unique_ptr<TierManager>> TierManager::create(
+    orc::SimpleJIT &JIT, uint64_t threshold, OptimizationLevel level,
+    const RemarkFilter &remarks) {
+  if (auto err = JIT.defineAbsolute(tierCountHook,
+                                    pointerToJITTargetAddress(&countHook))) {
+    return err;
+  }
+
+  return std::unique_ptr<TierManager>(
+      new TierManager(JIT, threshold, level, remarks));
+}
+
+void TierManager::countHook(uint32_t id) { activeTiers->count(id); }
+
+void TierManager::count(unsigned id) {
+  if (++counts[id] != threshold) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    hot.push_back(id);
+  }
+  wake.notify_one();
+}
+
+unsigned TierManager::registerFunction(StringRef name) {
+  std::lock_guard<std::mutex> guard(lock);
+  counts.push_back(0);
+  functions.push_back({name.str(), {}});
+  return functions.size() - 1;
+}
+
+Error TierManager::addDefinition(std::unique_ptr<Module> M,
+                                 std::unique_ptr<LLVMContext> context,
+                                 Function *F, unsigned id) {
+  std::string name = F->getName().str();
+
+  // Recursive calls have to go through the stub as well, or a hot recursive
+  // function would keep calling its baseline body.
+  Function *stubDecl = Function::Create(
+      F->getFunctionType(), Function::ExternalLinkage, "", M.get());
+  F->replaceAllUsesWith(stubDecl);
+  F->setName(name + ".t0");
+  stubDecl->setName(name);
+
+  SmallVector<char, 0> bitcode;
+  raw_svector_ostream OS(bitcode);
+  WriteBitcodeToFile(*M, OS);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    functions[id].bitcode = std::move(bitcode);
+  }
+
+  // The body may call itself through the stub, so the stub has to exist
+  // before the body is linked. Nothing can call it until it is pointed at
+  // the compiled body below.
+  if (auto err = JIT.defineStub(name, 0)) {
+    return err;
+  }
+
+  if (auto err = JIT.addBaselineModule(
+          orc::ThreadSafeModule(std::move(M), std::move(context)))) {
+    return err;
+  }
+
+  auto baseline = JIT.lookup(name + ".t0");
+  if (!baseline) {
+    return baseline.takeError();
+  }
+
+  return JIT.updateStub(name, baseline->getAddress());
+}
+
+void TierManager::run() {
+  while (true) {
+    std::string name;
+    SmallVector<char, 0> bitcode;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [this]() { return stopping || !hot.empty(); });
+      if (stopping) {
+        return;
+      }
+
+      TieredFunction &next = functions[hot.front()];
+      hot.pop_front();
+      name = next.name;
+      bitcode = std::move(next.bitcode);
+    }
+
+    if (auto err = recompile(name, std::move(bitcode))) {
+      logAllUnhandledErrors(std::move(err), errs(), "LogError: ");
+    }
+  }
+}
+
+Error TierManager::recompile(const std::string &name,
+                             SmallVector<char, 0> bitcode) {
+  auto context = std::make_unique<LLVMContext>();
+  auto M = parseBitcodeFile(
+      MemoryBufferRef(StringRef(bitcode.data(), bitcode.size()), name),
+      *context);
+  if (!M) {
+    return M.takeError();
+  }
+
+  if (Function *hook = (*M)->getFunction(tierCountHook)) {
+    for (User *U : make_early_inc_range(hook->users())) {
+      cast<CallInst>(U)->eraseFromParent();
+    }
+    hook->eraseFromParent();
+  }
+
+  // The baseline stub stays in place if the snapshot has no body to
+  // recompile.
+  Function *F = (*M)->getFunction(name + ".t0");
+  if (!F || F->isDeclaration()) {
+    return createStringError(inconvertibleErrorCode(),
+                             "no baseline body for " + name + " to recompile");
+  }
+  F->setName(name + ".t1");
+
+  optimiser.runOnFunction(*F);
+
+  if (auto err = JIT.addModule(
+          orc::ThreadSafeModule(std::move(*M), std::move(context)))) {
+    return err;
+  }
+
+  auto optimised = JIT.lookup(name + ".t1");
+  if (!optimised) {
+    return optimised.takeError();
+  }
+
+  return JIT.updateStub(name, optimised->getAddress());
+}
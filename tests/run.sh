@@ -0,0 +1,102 @@
+#!/bin/sh
+# Builds and runs the tests. The tree has no build manifest, so the test
+# programs are compiled straight from the sources against the LLVM that
+# llvm-config points at.
+#
+#   tests/run.sh
+#
+# $TEST_OUT (default /tmp/sltest) holds the binaries and the objects the
+# tests write.
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+out=${TEST_OUT:-/tmp/sltest}
+cxx=${CXX:-c++}
+llvmConfig=${LLVM_CONFIG:-llvm-config}
+
+cxxflags="-O2 $($llvmConfig --cppflags) -std=c++17"
+ldflags="$($llvmConfig --ldflags) $($llvmConfig --libs) -pthread"
+
+mkdir -p "$out"
+
+# Everything but the driver, which has its own main.
+sources=$(ls "$root"/src/*.cpp | grep -v '/driver\.cpp$')
+
+$cxx $cxxflags "$root/tests/sessionTest.cpp" $sources $ldflags \
+  -o "$out/sessionTest"
+"$out/sessionTest" "$out" ${TEST_COPIES:-4} "$root"/benchmarks/loops/*.sl
+
+# The compiler itself, linked without -rdynamic so the JIT modes have to
+# find the runtime functions on their own.
+$cxx $cxxflags "$root"/src/*.cpp $ldflags -o "$out/slc"
+
+# A chain of definitions, each calling the one before it, run in every JIT
+# mode. Materialising the chain on the first call used to overflow the
+# stack under -run.
+awk 'BEGIN {
+  print "extern printd(x);"
+  print "def f0(x) x + 1;"
+  for (i = 1; i < 3000; i++) printf "def f%d(x) f%d(x) + 1;\n", i, i - 1
+  print "printd(f2999(0));"
+}' > "$out/chain.sl"
+for mode in -run -lazy "-t 2"; do
+  result=$("$out/slc" $mode "$out/chain.sl" -p noir 2>&1 | tail -n 1) || true
+  if [ "$result" != "3000.000000" ]; then
+    echo "FAIL: slc $mode on a chain of 3000 definitions printed '$result'"
+    exit 1
+  fi
+  echo "PASS: slc $mode on a chain of 3000 definitions"
+done
+
+# A binary operator whose definition fails to lower gives its precedence up
+# again: f stops at x, and the later definition of | is the one 3 | 4 uses.
+# (With -pipeline the front end may have parsed f before the back end
+# rejects the operator, so only the serial path is checked.)
+cat > "$out/rejectedOperator.sl" <<'SL'
+extern printd(x);
+def binary | 5 (a, b) a + c;
+def f(x) x | 2;
+printd(f(1));
+def binary | 5 (a, b) a + b;
+printd(3 | 4);
+SL
+result=$("$out/slc" -run "$out/rejectedOperator.sl" -p noir 2>&1 |
+  grep -o '[0-9][0-9]*\.[0-9]*$' | tr '\n' ' ') || true
+if [ "$result" != "1.000000 7.000000 " ]; then
+  echo "FAIL: slc -run kept a rejected operator, printed '$result'"
+  exit 1
+fi
+echo "PASS: slc -run drops a rejected operator"
+
+# The JIT cache keys on the code, not on where it was read from: a renamed
+# copy of a script compiles nothing new.
+rm -rf "$out/renameCache"
+mkdir -p "$out/renamed"
+head -n 200 "$out/chain.sl" > "$out/renameFirst.sl"
+echo "printd(f198(0));" >> "$out/renameFirst.sl"
+cp "$out/renameFirst.sl" "$out/renamed/renameSecond.sl"
+"$out/slc" -run -cache "$out/renameCache" "$out/renameFirst.sl" -p noir \
+  > /dev/null 2>&1
+entries=$(ls "$out/renameCache" | wc -l)
+result=$("$out/slc" -run -cache "$out/renameCache" \
+  "$out/renamed/renameSecond.sl" -p noir 2>&1 | tail -n 1) || true
+if [ "$entries" -eq 0 ] || [ "$(ls "$out/renameCache" | wc -l)" -ne "$entries" ] ||
+   [ "$result" != "199.000000" ]; then
+  echo "FAIL: slc -run -cache missed on a renamed copy, printed '$result'"
+  exit 1
+fi
+echo "PASS: slc -run -cache hits on a renamed copy"
+
+# Loop hints only reach the loop optimisers of the whole-module pipeline;
+# builds without it say they were ignored.
+for flag in -O2 -Ofast-compile; do
+  warnings=$("$out/slc" $flag "$root/benchmarks/loops/hinted.sl" -p noir \
+    -o "$out/hinted.o" 2>&1 | grep -c 'warning: loop hints ignored') || true
+  expected=0
+  [ $flag = -Ofast-compile ] && expected=1
+  if [ "$warnings" -ne $expected ]; then
+    echo "FAIL: slc $flag printed $warnings ignored-hint warnings"
+    exit 1
+  fi
+  echo "PASS: slc $flag warns about ignored loop hints only when it ignores them"
+done
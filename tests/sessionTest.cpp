@@ -0,0 +1,109 @@
+// Compiles every source once in a session of its own, then again in many
+// sessions running at the same time on separate threads, and checks that
+// each concurrent session wrote exactly the object the lone one did.
+//
+//   sessionTest <scratch dir> <copies> <source>...
+//
+// Every source gets <copies> concurrent sessions.
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../include/compilerSession.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace {
+bool compileTo(const std::string &source, const std::string &object) {
+  CompilerOptions options;
+  options.fileName = source;
+  options.outFileName = object;
+  options.printIR = false;
+
+  CompilerSession session(options);
+  if (!session.openSource(source)) {
+    fprintf(stderr, "LogError: Could not open %s\n", source.c_str());
+    return false;
+  }
+  session.compile();
+  return session.getWrittenFile() == object;
+}
+
+std::unique_ptr<MemoryBuffer> readObject(const std::string &name) {
+  auto buffer = MemoryBuffer::getFile(name, /*IsText=*/false,
+                                      /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    fprintf(stderr, "LogError: Could not read %s\n", name.c_str());
+    return nullptr;
+  }
+  return std::move(*buffer);
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 4) {
+    fprintf(stderr, "usage: sessionTest <scratch dir> <copies> <source>...\n");
+    return 1;
+  }
+  std::string scratch = argv[1];
+  int copies = atoi(argv[2]);
+  std::vector<std::string> sources(argv + 3, argv + argc);
+
+  std::vector<std::unique_ptr<MemoryBuffer>> expected;
+  for (size_t i = 0; i < sources.size(); i++) {
+    std::string object = scratch + "/serial" + std::to_string(i) + ".o";
+    if (!compileTo(sources[i], object)) {
+      fprintf(stderr, "LogError: %s failed to compile\n", sources[i].c_str());
+      return 1;
+    }
+    expected.push_back(readObject(object));
+    if (!expected.back()) {
+      return 1;
+    }
+  }
+
+  // Each thread writes to an object of its own and reports through its
+  // own slot.
+  size_t sessions = sources.size() * copies;
+  std::vector<char> compiled(sessions, false);
+  std::vector<std::thread> threads;
+  for (size_t s = 0; s < sessions; s++) {
+    threads.emplace_back([&, s]() {
+      compiled[s] = compileTo(sources[s % sources.size()],
+                              scratch + "/parallel" + std::to_string(s) + ".o");
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  unsigned failures = 0;
+  for (size_t s = 0; s < sessions; s++) {
+    const std::string &source = sources[s % sources.size()];
+    if (!compiled[s]) {
+      fprintf(stderr, "FAIL: session %zu did not compile %s\n", s,
+              source.c_str());
+      failures++;
+      continue;
+    }
+
+    auto object = readObject(scratch + "/parallel" + std::to_string(s) + ".o");
+    if (!object || object->getBuffer() !=
+                       expected[s % sources.size()]->getBuffer()) {
+      fprintf(stderr, "FAIL: session %zu wrote a different object for %s\n",
+              s, source.c_str());
+      failures++;
+    }
+  }
+
+  if (failures) {
+    fprintf(stderr, "%u of %zu sessions failed\n", failures, sessions);
+    return 1;
+  }
+  printf("PASS: %zu concurrent sessions matched the serial objects\n",
+         sessions);
+  return 0;
+}